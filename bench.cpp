@@ -0,0 +1,283 @@
+#include <benchmark/benchmark.h>
+#include <string>
+#include "tiny_template.h"
+#include "test_templates/report.h" // generated by ttlc
+
+// compile with:
+// g++ -std=c++17 -O2 -DNDEBUG -pthread -I. bench.cpp tiny_template.cpp -o bench_ttl -lbenchmark
+// (after generating test_templates/report.h with ttlc, see the Makefile)
+//
+// machine-readable results:
+// ./bench_ttl --benchmark_out=bench_output.json --benchmark_out_format=json
+
+namespace
+{
+    // template generators
+
+    std::string text_heavy_template(int kb)
+    {
+        std::string tmpl;
+        std::string paragraph = "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore. ";
+        while (tmpl.size() < kb * 1024)
+        {
+            for (int i = 0; i < 40; ++i) tmpl += paragraph;
+            tmpl += "{$user.name}\n";
+        }
+        return tmpl;
+    }
+
+    std::string reference_heavy_template(int count)
+    {
+        std::string tmpl;
+        for (int i = 0; i < count; ++i) tmpl += "<td>{$user.name}</td><td>{$user.email}</td><td>{$count}</td>";
+        return tmpl;
+    }
+
+    std::string nested_if_template(int depth, int repeat)
+    {
+        std::string block;
+        for (int i = 0; i < depth; ++i) block += "{#if $flag}<" + std::to_string(i) + ">";
+        block += "{$user.name}";
+        for (int i = 0; i < depth; ++i) block += "{#else}never{#end}";
+        std::string tmpl;
+        for (int i = 0; i < repeat; ++i) tmpl += block;
+        return tmpl;
+    }
+
+    const char *join_template =
+        "<table>{#join $row in $rows with '\n'}<tr><td>{$row.id}</td><td>{$row.name}</td>"
+        "<td>{#if $row.name == 'row_7'}seven{#else}{$row.email}{#end}</td></tr>{#end}</table>";
+
+    ttl::context make_context(int rows)
+    {
+        ttl::context ctx;
+        ctx["user"] = ttl::map( { { "name", "Arthur Dent" }, { "email", "arthur.dent@example.com" } } );
+        ctx["count"] = 42;
+        ctx["flag"] = true;
+        ttl::vector items;
+        items.reserve(rows);
+        for (int i = 0; i < rows; ++i)
+        {
+            std::string name = "row_" + std::to_string(i);
+            items.push_back(ttl::map( { { "id", i }, { "name", name }, { "email", name + "@example.com" } } ));
+        }
+        ctx["rows"] = std::move(items);
+        return ctx;
+    }
+
+    enum engine { tree, bytecode, indexed_bytecode };
+
+    void render(benchmark::State &state, const std::string &source, int rows)
+    {
+        ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(source);
+        ttl::context ctx = make_context(rows);
+        engine eng = static_cast<engine>(state.range(0));
+        std::size_t size = 0;
+        for (auto _ : state)
+        {
+            std::string output;
+            if (eng == tree) output = tmpl->evaluate(ctx);
+            else if (eng == bytecode) output = tmpl->execute(ctx);
+            else output = tmpl->execute(ttl::indexed_context(*tmpl, ctx));
+            size = output.size();
+            benchmark::DoNotOptimize(output.data());
+        }
+        state.SetBytesProcessed(state.iterations() * size);
+        state.SetItemsProcessed(state.iterations());
+        state.counters["output_size"] = size;
+    }
+}
+
+// parse time vs template size
+
+void BM_parse(benchmark::State &state)
+{
+    std::string source = text_heavy_template(state.range(0) / 2) + reference_heavy_template(state.range(0) * 4);
+    for (auto _ : state)
+    {
+        ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(source);
+        benchmark::DoNotOptimize(tmpl.get());
+    }
+    state.SetBytesProcessed(state.iterations() * source.size());
+    state.counters["template_size"] = source.size();
+}
+BENCHMARK(BM_parse)->Arg(1)->Arg(16)->Arg(256)->Unit(benchmark::kMicrosecond);
+
+// parsing alone, with the hand-written parser (0) or the Spirit X3 grammar (1)
+
+void BM_parse_tree(benchmark::State &state)
+{
+    std::string source = text_heavy_template(64) + reference_heavy_template(256) + nested_if_template(8, 16) + join_template;
+    for (auto _ : state)
+    {
+        ttl::ast::node_ptr tree = state.range(0) ? ttl::ast::node::parse_spirit(source) : ttl::ast::node::parse(source);
+        benchmark::DoNotOptimize(tree.get());
+    }
+    state.SetBytesProcessed(state.iterations() * source.size());
+}
+BENCHMARK(BM_parse_tree)->ArgName("spirit")->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+// parse time into a per-template arena (1) or node by node (0)
+
+void BM_parse_arena(benchmark::State &state)
+{
+    std::string source = text_heavy_template(64) + reference_heavy_template(256) + nested_if_template(8, 16) + join_template;
+    ttl::parse_options options;
+    options.arena = state.range(0);
+    for (auto _ : state)
+    {
+        ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(source, options);
+        benchmark::DoNotOptimize(tmpl.get());
+    }
+    state.SetBytesProcessed(state.iterations() * source.size());
+}
+BENCHMARK(BM_parse_arena)->ArgName("arena")->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+// render throughput, by template kind and rendering engine (0: tree, 1: bytecode, 2: indexed bytecode)
+
+void BM_render_text_heavy(benchmark::State &state) { render(state, text_heavy_template(64), 0); }
+BENCHMARK(BM_render_text_heavy)->ArgName("engine")->DenseRange(tree, indexed_bytecode);
+
+void BM_render_reference_heavy(benchmark::State &state) { render(state, reference_heavy_template(1000), 0); }
+BENCHMARK(BM_render_reference_heavy)->ArgName("engine")->DenseRange(tree, indexed_bytecode);
+
+void BM_render_nested_if(benchmark::State &state) { render(state, nested_if_template(32, 100), 0); }
+BENCHMARK(BM_render_nested_if)->ArgName("engine")->DenseRange(tree, indexed_bytecode);
+
+void BM_render_large_join(benchmark::State &state) { render(state, join_template, 10000); }
+BENCHMARK(BM_render_large_join)->ArgName("engine")->DenseRange(tree, indexed_bytecode)->Unit(benchmark::kMicrosecond);
+
+// reference rendering without (0) or with html escaping (1)
+
+void BM_render_escaped(benchmark::State &state)
+{
+    ttl::parse_options options;
+    options.escape = state.range(0) ? ttl::escape_mode::html : ttl::escape_mode::none;
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(reference_heavy_template(1000), options);
+    ttl::context ctx = make_context(0);
+    std::size_t size = 0;
+    for (auto _ : state)
+    {
+        std::string output = tmpl->execute(ctx);
+        size = output.size();
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_render_escaped)->ArgName("escape")->Arg(0)->Arg(1);
+
+// test_templates/report.ttl rendered by the tree (0), the bytecode program (1) or its ttlc-generated function (2)
+
+void BM_render_generated(benchmark::State &state)
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse_file("test_templates/report.ttl");
+    ttl::context ctx = make_context(100);
+    ctx["name"] = "Arthur <Dent>";
+    ctx["user"] = ttl::map( { { "address", ttl::map( { { "city", "London" } } ) } } );
+    ctx["items"] = ttl::vector( { "foo", "bar & baz", "qux" } );
+    ctx["sep"] = ", ";
+    std::size_t size = 0;
+    for (auto _ : state)
+    {
+        std::string output = state.range(0) == 0 ? tmpl->evaluate(ctx) : state.range(0) == 1 ? tmpl->execute(ctx) : render_report(ctx);
+        size = output.size();
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_render_generated)->ArgName("engine")->DenseRange(0, 2);
+
+// large join rendered serially (0) or in parallel over a thread pool (1)
+
+void BM_render_parallel_join(benchmark::State &state)
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(join_template);
+    ttl::context ctx = make_context(100000);
+    ttl::thread_pool pool;
+    ttl::parallel_options parallel;
+    if (state.range(0)) parallel.pool = &pool;
+    std::size_t size = 0;
+    for (auto _ : state)
+    {
+        std::string output = tmpl->evaluate(ctx, parallel);
+        size = output.size();
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_render_parallel_join)->ArgName("parallel")->Arg(0)->Arg(1)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// one template over many small contexts: evaluate() in a loop (0), or evaluate_batch() serially (1) or on a pool (2)
+
+void BM_render_batch(benchmark::State &state)
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(reference_heavy_template(10));
+    std::vector<ttl::context> contexts(1000, make_context(0));
+    ttl::thread_pool pool;
+    std::size_t size = 0;
+    for (auto _ : state)
+    {
+        size = 0;
+        if (state.range(0) == 0)
+        {
+            for (const ttl::context &ctx : contexts) size += tmpl->evaluate(ctx).size();
+        }
+        else tmpl->evaluate_batch(contexts, [&](std::size_t, std::string_view output, std::exception_ptr) { size += output.size(); },
+                                  state.range(0) == 2 ? &pool : nullptr);
+        benchmark::DoNotOptimize(size);
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    state.SetItemsProcessed(state.iterations() * contexts.size());
+}
+BENCHMARK(BM_render_batch)->ArgName("mode")->DenseRange(0, 2)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// to_json on a big context
+
+void BM_to_json(benchmark::State &state)
+{
+    ttl::context ctx = make_context(state.range(0));
+    std::size_t size = 0;
+    for (auto _ : state)
+    {
+        std::string json = ttl::to_json(ctx);
+        size = json.size();
+        benchmark::DoNotOptimize(json.data());
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_to_json)->Arg(100)->Arg(10000)->Unit(benchmark::kMicrosecond);
+
+// from_json of a big payload, copying (0) or borrowing (1) strings
+
+void BM_from_json(benchmark::State &state)
+{
+    std::string json = ttl::to_json(make_context(10000));
+    ttl::json_mode mode = state.range(0) ? ttl::json_mode::borrow : ttl::json_mode::copy;
+    for (auto _ : state)
+    {
+        ttl::context ctx = ttl::from_json(json, mode);
+        benchmark::DoNotOptimize(ctx.size());
+    }
+    state.SetBytesProcessed(state.iterations() * json.size());
+}
+BENCHMARK(BM_from_json)->ArgName("borrow")->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+// multi-threaded scaling: all threads render the same template
+
+void BM_render_threads(benchmark::State &state)
+{
+    static ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(join_template);
+    static ttl::context ctx = make_context(1000);
+    std::size_t size = 0;
+    for (auto _ : state)
+    {
+        std::string output = tmpl->execute(ctx);
+        size = output.size();
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_render_threads)->ThreadRange(1, 8)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,41 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include "tiny_template.h"
+#include "test_samples.h"
+
+// generates render_sample_<n> functions for the templates of test_samples.h, through
+// ttl::generate_cpp(), for the tests to check them against tiny_template::evaluate()
+//
+// compile with:
+// g++ -std=c++17 -pthread -I. gen_samples.cpp tiny_template.cpp -o gen_samples
+//
+// usage: gen_samples <header file>
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        std::cerr << "usage: gen_samples <header file>" << std::endl;
+        return 2;
+    }
+    std::string header, table;
+    for (std::size_t i = 0; i < std::size(samples); ++i)
+    {
+        std::string name = "render_sample_" + std::to_string(i);
+        header += ttl::generate_cpp(*ttl::tiny_template::parse(samples[i]), name) + "\n";
+        table += "    " + name + ",\n";
+    }
+    header += "// by index in samples[]\n"
+              "inline std::string (*const sample_renderers[])(const ttl::context &ctx) =\n"
+              "{\n" + table + "};\n";
+    std::ofstream out(argv[1], std::ios::binary);
+    out << header;
+    if (!out.flush())
+    {
+        std::cerr << "gen_samples: cannot write '" << argv[1] << "'" << std::endl;
+        return 1;
+    }
+    return 0;
+}
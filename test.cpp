@@ -1,11 +1,60 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <fstream>
 #include <streambuf>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 #include "tiny_template.h"
+#include "test_samples.h"
+#include "test_templates/report.h" // generated by ttlc
+#include "test_templates/samples.h" // generated by gen_samples
 
 // compile with:
-// g++ -std=c++14 test.cpp tiny_template.cpp -o test_ttl
+// g++ -std=c++17 test.cpp tiny_template.cpp -o test_ttl
+
+int failures = 0;
+
+void check(bool condition, const std::string &what)
+{
+    if (!condition)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+// templates and context shared by differential tests
+ttl::context sample_context()
+{
+    return ttl::context
+    {
+        { "name", "arthur" },
+        { "surname", "dent" },
+        { "count", 42 },
+        { "ratio", 0.25 },
+        { "flag", true },
+        { "zero", 0 },
+        { "sep", " | " },
+        { "empty", ttl::vector() },
+        { "items", ttl::vector( { "foo", "bar", "baz" } ) },
+        { "user", ttl::map( { { "address", ttl::map( { { "city", "London" } } ) } } ) },
+        { "rows", ttl::vector( {
+            ttl::map( { { "id", 1 }, { "tags", ttl::vector( { "a", "b" } ) } } ),
+            ttl::map( { { "id", 2 }, { "tags", ttl::vector() } } ),
+            ttl::map( { { "id", 3 }, { "tags", "single" } } ) } ) }
+    };
+}
+
+// output of a render, or the error it raised
+template <typename Render> std::string outcome(Render render)
+{
+    try { return render(); }
+    catch (std::exception &e) { return std::string("error: ") + e.what(); }
+}
 
 void test1()
 {
@@ -26,6 +75,376 @@ void test1()
     std::cout << result << std::endl;
 }
 
+void test_sinks()
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(
+        "{#join $item in $items with ', '}<{$item}>{#end}");
+    ttl::context context;
+    context["items"] = ttl::vector( { "foo", "bar", "baz" } );
+    std::string expected = "<foo>, <bar>, <baz>";
+
+    check(tmpl->evaluate(context) == expected, "string evaluation");
+
+    std::string appended = "items: ";
+    ttl::string_sink str_out(appended);
+    tmpl->evaluate_to(str_out, context);
+    check(appended == "items: " + expected, "string sink");
+
+    std::ostringstream oss;
+    ttl::stream_sink stream_out(oss);
+    tmpl->evaluate_to(stream_out, context);
+    check(oss.str() == expected, "stream sink");
+
+    char buffer[64];
+    ttl::buffer_sink buf_out(buffer, sizeof(buffer));
+    tmpl->evaluate_to(buf_out, context);
+    check(!buf_out.overflow() && std::string(buffer, buf_out.size()) == expected, "buffer sink");
+
+    char small[8];
+    ttl::buffer_sink small_out(small, sizeof(small));
+    tmpl->evaluate_to(small_out, context);
+    check(small_out.overflow() && small_out.required() == expected.size() &&
+          std::string(small, small_out.size()) == expected.substr(0, sizeof(small)), "buffer sink overflow");
+
+    std::string chunks;
+    int calls = 0;
+    ttl::callback_sink cb_out([&](const char *data, std::size_t size) { chunks.append(data, size); ++calls; });
+    tmpl->evaluate_to(cb_out, context);
+    check(chunks == expected && calls > 1, "callback sink");
+}
+
+void test_nested_joins()
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(
+        "{$row}:{#join $row in $rows with ';'}{#join $cell in $row.cells with ','}{$row.name}={$cell}{#end}{#end}:{$row}");
+    ttl::context context;
+    context["row"] = "outer";
+    context["rows"] = ttl::vector( {
+        ttl::map( { { "name", "a" }, { "cells", ttl::vector( { "1", "2" } ) } } ),
+        ttl::map( { { "name", "b" }, { "cells", ttl::vector( { "3" } ) } } )
+    } );
+    check(tmpl->evaluate(context) == "outer:a=1,a=2;b=3:outer", "nested joins");
+}
+
+void test_indexed_context()
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(
+        "{$user.name}{#if $missing} never{#end} {#join $user in $users with ','}{$user.name}{#end} {$user.name}");
+    ttl::context context;
+    context["user"] = ttl::map( { { "name", "john" } } );
+    context["users"] = ttl::vector( { ttl::map( { { "name", "a" } } ), ttl::map( { { "name", "b" } } ) } );
+
+    check(tmpl->symbols().find("user") != ttl::symbol_table::npos, "symbol interning");
+    check(tmpl->slots().size() == 3, "slot allocation"); // $user.name, $missing, $users
+    ttl::indexed_context indexed(*tmpl, context);
+    check(tmpl->evaluate(indexed) == "john a,b john", "indexed evaluation");
+    check(tmpl->evaluate(indexed) == tmpl->evaluate(context), "indexed vs plain evaluation");
+}
+
+void test_values()
+{
+    std::string long_string(40, 'x');
+    std::string borrowed = "borrowed";
+    ttl::context context
+    {
+        { "short", "abc" },
+        { "long", long_string },
+        { "view", ttl::value(std::string_view(borrowed)) },
+        { "count", 42 },
+        { "ratio", 0.5 },
+        { "flag", true },
+        { "zero", 0 },
+        { "empty", ttl::vector() }
+    };
+    check(context["short"].type() == ttl::value::kind::string && context["short"].as_string() == "abc", "small string");
+    check(context["long"].as_string() == long_string, "heap string");
+    ttl::value copy = context["long"];
+    check(copy.as_string() == long_string, "heap string copy");
+
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(
+        "{$short} {$view} {$count} {$ratio} {$flag}{#if $zero} zero{#end}{#if $empty} empty{#end}");
+    check(tmpl->evaluate(context) == "abc borrowed 42 0.5 true", "scalar rendering");
+
+    // legacy boost::any contexts
+    ttl::any_map legacy;
+    legacy["name"] = std::string("john");
+    legacy["items"] = ttl::any_vector( { std::string("a"), 1 } );
+    legacy["nested"] = ttl::any_map( { { "flag", false } } );
+    ttl::context converted = ttl::make_context(legacy);
+    check(ttl::to_json(converted) == "{\"items\":[\"a\",1],\"name\":\"john\",\"nested\":{\"flag\":false}}", "legacy context conversion");
+}
+
+void test_template_cache()
+{
+    std::atomic<int> loads(0);
+    ttl::template_cache cache([&](const std::string &name) { ++loads; return "<{$" + name + "}>"; }, 4);
+    ttl::context context { { "a", "1" }, { "b", "2" } };
+
+    check(cache.get("a") == cache.get("a") && loads == 1, "cache hit");
+    check(cache.get("b")->evaluate(context) == "<2>", "cache loader");
+    check(cache.parse("{$a}") == cache.parse("{$a}") && cache.size() == 3, "cache by source");
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&]()
+        {
+            for (int i = 0; i < 1000; ++i) cache.get(i % 2 ? "a" : "b");
+        });
+    }
+    for (std::thread &thread : threads) thread.join();
+    check(loads == 2, "concurrent cache lookups");
+
+    for (const char *name : { "c", "d", "e", "f", "g", "h" }) cache.get(name);
+    check(cache.size() == 4, "cache eviction");
+    cache.get("e");
+    check(loads == 8, "cache lru");
+    check(cache.erase("h") && !cache.erase("h"), "cache erase");
+
+    // used entries get a second chance: "w" survives the insert of "a", "x" does not
+    ttl::template_cache clock([&](const std::string &name) { ++loads; return name; }, 4);
+    for (const char *name : { "w", "x", "y", "z" }) clock.get(name);
+    clock.get("w");
+    loads = 0;
+    clock.get("a");
+    clock.get("w");
+    check(loads == 1 && clock.size() == 4, "cache second chance");
+    clock.get("x");
+    check(loads == 2, "cache clock eviction");
+}
+
+void test_concurrent_rendering()
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(
+        "{#join $row in $rows with '\n'}{$row.id}:{#if $row.name == 'b'}[{$row.name}]{#elseif $row.name}{$row.name}{#else}-{#end}"
+        "{#join $tag in $row.tags with ','}{$tag}{#end}{#end} ({$missing})");
+    ttl::context context;
+    ttl::vector rows;
+    for (int i = 0; i < 100; ++i)
+    {
+        const char *names[] = { "a", "b", "" };
+        rows.push_back(ttl::map( { { "id", i }, { "name", names[i % 3] }, { "tags", ttl::vector( { "x", "y" } ) } } ));
+    }
+    context["rows"] = rows;
+    ttl::indexed_context indexed(*tmpl, context);
+    const std::string expected = tmpl->evaluate(context);
+
+    unsigned int thread_count = std::max(8u, std::thread::hardware_concurrency());
+    std::vector<int> mismatches(thread_count, 0);
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < thread_count; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            for (int i = 0; i < 200; ++i)
+            {
+                if ((i % 2 ? tmpl->evaluate(indexed) : tmpl->evaluate(context)) != expected) ++mismatches[t];
+            }
+        });
+    }
+    for (std::thread &thread : threads) thread.join();
+    int total = 0;
+    for (int m : mismatches) total += m;
+    check(total == 0, "concurrent rendering of a shared template");
+}
+
+void test_bytecode()
+{
+    ttl::context context = sample_context();
+    for (const char *sample : samples)
+    {
+        ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(sample);
+        ttl::indexed_context indexed(*tmpl, context);
+        std::string expected = outcome([&]() { return tmpl->evaluate(context); });
+        check(outcome([&]() { return tmpl->execute(context); }) == expected, std::string("bytecode: ") + sample);
+        check(outcome([&]() { return tmpl->execute(indexed); }) == expected, std::string("indexed bytecode: ") + sample);
+    }
+    // errors
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse("{$name.first}");
+    check(outcome([&]() { return tmpl->execute(context); }) == outcome([&]() { return tmpl->evaluate(context); }), "bytecode error");
+}
+
+void test_parsers()
+{
+    std::vector<std::string> sources(std::begin(samples), std::end(samples));
+    const char *edge_cases[] =
+    {
+        "{#if   $name   ==   'arthur'  }a{#end}",
+        "{#if\t$name\n}a{#elseif\r\n$surname ==$name}b{#else}c{#end}",
+        "{#if $name == '}'}brace{#end}{#if $name == '{'}x{#end}",
+        "{#join\t$i\nin\r$items\twith\n'-'}{$i}{#end}",
+        "a{#if $name}{#if $surname}nested{#end}{#end}b",
+        "{$name.}", "{$ name}", "{#if $name}", "{#if $name}{#end", "{#ifx $name}{#end}", "{#join $a.b in $items}{#end}",
+        "{#join $a in $items }{#end}", "{#join $a in $items with ''}{#end}", "{#if $name ==}{#end}", "{#else}", "{#end}",
+        "text {", "{}", "{$}", "{#if $a}x{#else}y{#elseif $b}z{#end}", "$name}", "}{$name}{",
+        "{$name|}", "{$name|xml}", "{$name |html}", "{#join $i in $items with $sep}{$i|url}{#end}",
+        "{#if $count<'50'}a{#end}{#if $count>=$zero}b{#end}", "{#if $name => 'a'}{#end}", "{#if $name ! 'a'}{#end}", "{#if $name <}{#end}",
+    };
+    sources.insert(sources.end(), std::begin(edge_cases), std::end(edge_cases));
+    ttl::context context = sample_context();
+    for (const std::string &source : sources)
+    {
+        ttl::ast::node_ptr spirit, descent;
+        std::string spirit_error = outcome([&]() { spirit = ttl::ast::node::parse_spirit(source); return std::string(); });
+        std::string descent_error = outcome([&]() { descent = ttl::ast::node::parse(source); return std::string(); });
+        check(spirit_error.empty() == descent_error.empty(), "parsers agreement on validity: " + source);
+        if (!spirit || !descent) continue;
+        check(spirit->debug() == descent->debug(), "parsers agreement on tree: " + source);
+        check(outcome([&]() { return spirit->evaluate(context); }) == outcome([&]() { return descent->evaluate(context); }),
+              "parsers agreement on output: " + source);
+    }
+}
+
+void test_comparisons()
+{
+    ttl::context context = sample_context();
+    struct { const char *source; const char *expected; } cases[] =
+    {
+        { "{#if $count == '42.0'}a{#end}{#if $count != '42'}b{#end}{#if $count < '100'}c{#end}{#if $count > '5'}d{#end}", "acd" },
+        { "{#if $ratio >= '0.25'}a{#end}{#if $ratio < $count}b{#end}{#if $zero <= '-1'}c{#end}", "ab" },
+        { "{#if $name < 'b'}a{#end}{#if $name > $surname}b{#end}{#if '10' < '9'}c{#end}{#if $count < 'x'}d{#end}", "acd" },
+        { "{#if $missing < 'a'}a{#end}{#if $flag == 'true'}b{#end}{#if $flag > 'false'}c{#end}", "abc" },
+    };
+    for (auto &c : cases)
+    {
+        ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(c.source);
+        check(tmpl->evaluate(context) == c.expected && tmpl->execute(context) == c.expected, std::string("comparison: ") + c.source);
+    }
+}
+
+void test_escaping()
+{
+    auto escaped = [](std::string_view str, ttl::escape_mode mode)
+    {
+        std::string ret;
+        ttl::string_sink out(ret);
+        ttl::escape(out, str, mode);
+        return ret;
+    };
+    check(escaped("<a href=\"x\">Tom & Jerry's</a>", ttl::escape_mode::html) ==
+          "&lt;a href=&quot;x&quot;&gt;Tom &amp; Jerry&#39;s&lt;/a&gt;", "html escaping");
+    check(escaped("line\n\"quoted\" \\ \x01", ttl::escape_mode::json) == "line\\n\\\"quoted\\\" \\\\ \\u0001", "json escaping");
+    check(escaped("a b/c?d=é~_.-", ttl::escape_mode::url) == "a%20b%2Fc%3Fd%3D%C3%A9~_.-", "url escaping");
+    // every char, at every position of a vectorized chunk, escapes as alone
+    bool consistent = true;
+    for (ttl::escape_mode mode : { ttl::escape_mode::html, ttl::escape_mode::json, ttl::escape_mode::url })
+    {
+        for (int c = 0; c < 256; ++c)
+        {
+            std::string alone = escaped(std::string(1, char(c)), mode);
+            for (std::size_t offset = 0; offset < 20; ++offset)
+            {
+                std::string str = std::string(offset, 'a') + char(c) + std::string(40 - offset, 'b');
+                consistent &= escaped(str, mode) == std::string(offset, 'a') + alone + std::string(40 - offset, 'b');
+            }
+        }
+    }
+    check(consistent, "vectorized escaping");
+    ttl::context context = sample_context();
+    context["name"] = "<b>arthur & co</b>";
+    ttl::parse_options options;
+    options.escape = ttl::escape_mode::html;
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse("{$name} {$name|raw} {$name|url} {#join $i in $items with $name}{$i}{#end}", options);
+    std::string expected = "&lt;b&gt;arthur &amp; co&lt;/b&gt; <b>arthur & co</b> %3Cb%3Earthur%20%26%20co%3C%2Fb%3E "
+                           "foo&lt;b&gt;arthur &amp; co&lt;/b&gt;bar&lt;b&gt;arthur &amp; co&lt;/b&gt;baz";
+    check(tmpl->evaluate(context) == expected && tmpl->execute(context) == expected, "default escaping");
+}
+
+void test_size_hints()
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse("<ul>{#join $item in $items}<li>{$item}</li>{#end}</ul>");
+    check(tmpl->static_size() >= 9 && tmpl->size_hint() == tmpl->static_size(), "static size estimate");
+
+    ttl::context context;
+    context["items"] = ttl::vector(std::vector<ttl::value>(1000, "some item"));
+    std::string result = tmpl->evaluate(context);
+    check(tmpl->size_hint() > tmpl->static_size() && tmpl->size_hint() < result.size(), "size hint bounded growth");
+    for (int i = 0; i < 8; ++i) tmpl->evaluate(context);
+    check(tmpl->size_hint() == result.size(), "size hint growth");
+    context["items"] = ttl::vector(std::vector<ttl::value>(10, "some item"));
+    std::size_t small = tmpl->execute(context).size();
+    check(tmpl->size_hint() < result.size() && tmpl->size_hint() > result.size() / 4, "size hint shrinkage");
+    for (int i = 0; i < 16; ++i) tmpl->execute(context);
+    check(tmpl->size_hint() == small, "size hint steady shrinkage");
+    // a single large render does not make the next ones reserve its size
+    context["items"] = ttl::vector(std::vector<ttl::value>(100000, "some item"));
+    tmpl->execute(context);
+    check(tmpl->size_hint() <= small + 1024, "size hint outlier");
+    context["items"] = ttl::vector(std::vector<ttl::value>(10, "some item"));
+    for (int i = 0; i < 16; ++i) tmpl->execute(context);
+    check(tmpl->size_hint() == small, "size hint after outlier");
+
+    char buffer[64];
+    std::size_t required = tmpl->execute_to(buffer, sizeof(buffer), context);
+    check(required == 9 + 10 * 18 && std::string(buffer, sizeof(buffer)) == tmpl->execute(context).substr(0, sizeof(buffer)), "truncated buffer render");
+    std::vector<char> larger(required);
+    check(tmpl->execute_to(larger.data(), larger.size(), context) == required &&
+          std::string(larger.begin(), larger.end()) == tmpl->execute(context), "buffer render");
+}
+
+void test_json()
+{
+    ttl::context context
+    {
+        { "text", "quote \" backslash \\ newline \n tab \t bell \x07 unicode \xc3\xa9 long enough to span several vectors" },
+        { "numbers", ttl::vector( { 1, -2, 0.5, true, ttl::value() } ) },
+        { "nested", ttl::map( { { "empty", ttl::vector() }, { "object", ttl::map() } } ) }
+    };
+    check(ttl::to_json(context) ==
+          "{\"nested\":{\"empty\":[],\"object\":{}},\"numbers\":[1,-2,0.5,true,null],"
+          "\"text\":\"quote \\\" backslash \\\\ newline \\n tab \\t bell \\u0007 unicode \xc3\xa9 long enough to span several vectors\"}",
+          "compact json");
+    check(ttl::to_json(ttl::context { { "a", ttl::vector( { 1, 2 } ) }, { "b", ttl::map() } }, ttl::json_style::pretty) ==
+          "{\n  \"a\": [\n    1,\n    2\n  ],\n  \"b\": {}\n}", "pretty json");
+
+    // escapes at every position of a vector width
+    for (std::size_t pos = 0; pos < 40; ++pos)
+    {
+        std::string str(40, 'x');
+        str[pos] = '"';
+        std::string expected = "{\"k\":\"" + str.substr(0, pos) + "\\\"" + str.substr(pos + 1) + "\"}";
+        check(ttl::to_json(ttl::context { { "k", str } }) == expected, "json escape at " + std::to_string(pos));
+    }
+
+    // streaming
+    ttl::context big;
+    ttl::vector rows;
+    for (int i = 0; i < 1000; ++i) rows.push_back(ttl::map( { { "id", i }, { "name", "row" } } ));
+    big["rows"] = rows;
+    std::string streamed;
+    int writes = 0;
+    ttl::callback_sink out([&](const char *data, std::size_t size) { streamed.append(data, size); ++writes; });
+    ttl::to_json(out, big);
+    check(streamed == ttl::to_json(big) && writes > 1, "streamed json");
+}
+
+void test_from_json()
+{
+    std::string json = " { \"name\" : \"a rather long name, not stored inline\", \"escaped\": \"tab\\t \\u00e9 \\ud83d\\ude00\","
+        " \"count\": -42, \"ratio\": 2.5e-1, \"big\": 12345678901234567890, \"flag\": false, \"none\": null,"
+        " \"items\": [ \"a\", [ 1, [] ], { } ], \"user\": { \"address\": { \"city\": \"London\" } } } ";
+    ttl::context copied = ttl::from_json(json);
+    ttl::context borrowed = ttl::from_json(json, ttl::json_mode::borrow);
+    check(copied["name"].type() == ttl::value::kind::string && borrowed["name"].type() == ttl::value::kind::string_view &&
+          borrowed["name"].as_string().data() >= json.data() && borrowed["name"].as_string().data() < json.data() + json.size(),
+          "json borrowed strings");
+    check(copied["escaped"].as_string() == "tab\t \xc3\xa9 \xf0\x9f\x98\x80" && borrowed["escaped"].type() == ttl::value::kind::string,
+          "json escape sequences");
+    check(copied["count"].as_integer() == -42 && copied["ratio"].as_real() == 0.25 && copied["big"].type() == ttl::value::kind::real &&
+          !copied["flag"].as_boolean() && copied["none"].is_null(), "json scalars");
+    check(ttl::to_json(copied) == ttl::to_json(borrowed) && ttl::to_json(ttl::from_json(ttl::to_json(copied))) == ttl::to_json(copied),
+          "json round trip");
+    check(ttl::tiny_template::parse("{$user.address.city} {#join $i in $items with ','}{#if $i}x{#end}{#end}")->evaluate(borrowed) == "London x,x,",
+          "rendering from json");
+
+    const char *invalid[] = { "", "[]", "{", "{\"a\"}", "{\"a\":}", "{\"a\":1,}", "{\"a\":01}", "{\"a\":\"\\x\"}",
+                              "{\"a\":\"\\ud800\"}", "{\"a\":tru}", "{} x", "{\"a\":\"\n\"}", "{\"a\":1e999}" };
+    for (const char *source : invalid)
+    {
+        check(outcome([&]() { ttl::from_json(source); return std::string(); }).find("error: json") == 0, std::string("invalid json: ") + source);
+    }
+}
+
 /* in progress...
 void test2()
 {
@@ -48,9 +467,364 @@ void test2()
 }
 */
 
+void test_arenas()
+{
+    ttl::context context = sample_context();
+    ttl::scratch_arena scratch(256);
+    for (const char *sample : samples)
+    {
+        ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(sample);
+        ttl::tiny_template_ptr arena_tmpl = ttl::tiny_template::parse(sample, ttl::parse_options{ true });
+        check(arena_tmpl->debug() == tmpl->debug(), std::string("arena tree: ") + sample);
+        std::string expected = outcome([&]() { return tmpl->evaluate(context); });
+        check(outcome([&]() { return arena_tmpl->evaluate(context); }) == expected, std::string("arena render: ") + sample);
+        // the same scratch arena, reset between renders
+        for (int engine = 0; engine < 2; ++engine)
+        {
+            std::string result = outcome([&]()
+            {
+                std::string ret;
+                ttl::string_sink out(ret);
+                if (engine) arena_tmpl->execute_to(out, context, &scratch);
+                else arena_tmpl->evaluate_to(out, context, &scratch);
+                return ret;
+            });
+            scratch.reset();
+            check(result == expected, std::string("scratch render: ") + sample);
+        }
+    }
+
+    // lazy values resolved by the render are kept in the scratch arena
+    ttl::context lazy_context;
+    lazy_context["user"] = ttl::lazy([]() { return ttl::value(ttl::map({ { "name", "Zaphod" } })); });
+    lazy_context["now"] = ttl::lazy([]() { return ttl::value(42); }, false);
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse("{$user.name} {$now} {$user.name} {$now}");
+    for (int engine = 0; engine < 2; ++engine)
+    {
+        std::string result;
+        ttl::string_sink out(result);
+        if (engine) tmpl->execute_to(out, lazy_context, &scratch);
+        else tmpl->evaluate_to(out, lazy_context, &scratch);
+        scratch.reset();
+        check(result == "Zaphod 42 Zaphod 42", "scratch lazy values");
+    }
+}
+
+void test_lazy_values()
+{
+    int fetches = 0, computations = 0;
+    ttl::context context;
+    context["flag"] = false;
+    context["user"] = ttl::lazy([&]() { ++fetches; return ttl::value(ttl::map({ { "name", "Arthur" }, { "id", 42 } })); });
+    context["rows"] = ttl::lazy([&]() { ++fetches; return ttl::value(ttl::vector({ "a", "b" })); });
+    context["now"] = ttl::lazy([&]() { return ttl::value(++computations); }, false);
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(
+        "{#if $flag}{$rows}{#else}{$user.name}#{$user.id}{#end} {#join $row in $rows with ','}{$row}{$now}{#end}");
+    ttl::indexed_context indexed(*tmpl, context);
+    const char *expected = "Arthur#42 a1,b2";
+    for (int engine = 0; engine < 4; ++engine)
+    {
+        fetches = computations = 0;
+        std::string result = outcome([&]()
+        {
+            switch (engine)
+            {
+                case 0: return tmpl->evaluate(context);
+                case 1: return tmpl->execute(context);
+                case 2: return tmpl->evaluate(indexed);
+                default: return tmpl->execute(indexed);
+            }
+        });
+        check(result == expected && fetches == 2 && computations == 2, "lazy values, engine " + std::to_string(engine));
+    }
+    fetches = 0;
+    check(ttl::tiny_template::parse("{#if $flag}{$user.name}{#end}")->execute(context).empty() && fetches == 0, "unreached lazy value");
+    check(ttl::to_json(context, ttl::json_style::compact).find("\"rows\":[\"a\",\"b\"]") != std::string::npos, "lazy value json");
+}
+
+void test_dependencies()
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(
+        "{#if $user.admin == 'yes'}{$user.name}{#end}"
+        "{#join $row in $table.rows with $sep}{#join $cell in $row.cells}{$cell.value}{$row.id}{#end}{#end}"
+        "{#join $user in $users}{$user.name}{#end}");
+    std::set<std::string> expected = { "user.admin", "user.name", "table.rows", "sep", "table.rows[].cells",
+        "table.rows[].cells[].value", "table.rows[].id", "users", "users[].name" };
+    check(tmpl->dependencies() == expected, "template dependencies");
+}
+
+void test_incremental_rendering()
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(
+        "<h1>{$title}</h1>{#if $user.admin}<b>{$user.name}</b>{#else}{$user.name}{#end}"
+        "<ul>{#join $item in $items with ', '}<li>{$item.label}: {$item.count}{$unit}</li>{#end}</ul>");
+    ttl::context context;
+    context["title"] = "Dashboard";
+    context["user"] = ttl::map({ { "name", "Ford" }, { "admin", true } });
+    context["items"] = ttl::vector({ ttl::map({ { "label", "cpu" }, { "count", 12 } }), ttl::map({ { "label", "mem" }, { "count", 64 } }) });
+    context["unit"] = "%";
+    ttl::render_memo memo;
+    check(tmpl->evaluate(context, memo) == tmpl->evaluate(context), "first incremental render");
+    std::size_t misses = memo.misses();
+    check(tmpl->evaluate(context, memo) == tmpl->evaluate(context) && memo.misses() == misses && memo.hits() == 1, "unchanged incremental render");
+    context["items"].as_vector()[1].as_map()["count"] = 65;
+    std::size_t hits = memo.hits();
+    check(tmpl->evaluate(context, memo) == tmpl->evaluate(context) && memo.hits() == hits + 1, "partial incremental render");
+    context["unit"] = " percent";
+    context["user"].as_map()["admin"] = false;
+    check(tmpl->evaluate(context, memo) == tmpl->evaluate(context), "dirty incremental render");
+    context.erase("user");
+    check(outcome([&]() { return tmpl->evaluate(context, memo); }) == outcome([&]() { return tmpl->evaluate(context); }), "incremental render error");
+
+    // lazy values of the branches not taken are not resolved, as in full renders
+    int calls = 0;
+    ttl::context lazy_context { { "flag", false }, { "first", true } };
+    lazy_context["costly"] = ttl::lazy([&]() { ++calls; return ttl::value("costly"); });
+    ttl::tiny_template_ptr branches = ttl::tiny_template::parse("{#if $flag}{$costly}{#else}cheap{#end} {#if $first}1{#elseif $costly}2{#end}");
+    ttl::render_memo lazy_memo;
+    check(branches->evaluate(lazy_context, lazy_memo) == "cheap 1" && branches->evaluate(lazy_context, lazy_memo) == "cheap 1" && calls == 0,
+          "incremental render of lazy values");
+    lazy_context["flag"] = true;
+    check(branches->evaluate(lazy_context, lazy_memo) == "costly 1" && calls == 1, "incremental render of a taken branch");
+
+    // a template allocated where a freed one was must not replay its fragments
+    ttl::context names { { "name", "x" } };
+    ttl::tiny_template_ptr old_tmpl = ttl::tiny_template::parse("{#if $name}OLD {$name}{#end}");
+    old_tmpl->evaluate(names, memo);
+    old_tmpl.reset();
+    ttl::tiny_template_ptr new_tmpl = ttl::tiny_template::parse("{#if $name}NEW {$name}{#end}");
+    check(new_tmpl->evaluate(names, memo) == "NEW x", "incremental render of a new template");
+}
+
+void test_parallel_join()
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(
+        "{#join $row in $rows with $sep}{$row.id}:{#join $cell in $row.cells with ','}{$cell}{#if $cell == $row.id}!{#end}{#end}{#end}");
+    ttl::context context;
+    ttl::vector rows;
+    for (int i = 0; i < 1000; ++i) rows.push_back(ttl::map({ { "id", i }, { "cells", ttl::vector({ i, i + 1, i % 7 }) } }));
+    context["rows"] = std::move(rows);
+    context["sep"] = ttl::lazy([]() { return ttl::value(";\n"); });
+    std::string expected = tmpl->evaluate(context);
+    ttl::thread_pool pool(3);
+    ttl::parallel_options parallel;
+    parallel.pool = &pool;
+    parallel.threshold = 2;
+    check(tmpl->evaluate(context, parallel) == expected, "parallel join");
+    parallel.threshold = 100000;
+    check(tmpl->evaluate(context, parallel) == expected, "parallel join under threshold");
+    parallel.threshold = 2;
+    context["rows"].as_vector()[567] = 5;
+    check(outcome([&]() { return tmpl->evaluate(context, parallel); }) == outcome([&]() { return tmpl->evaluate(context); }), "parallel join error");
+}
+
+void test_batch_rendering()
+{
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse("Dear {$user.name},{#if $user.vip} thanks!{#end}");
+    std::vector<ttl::context> contexts;
+    for (int i = 0; i < 500; ++i)
+    {
+        ttl::context context;
+        if (i % 97 != 13) context["user"] = ttl::map({ { "name", "user_" + std::to_string(i) }, { "vip", i % 3 == 0 } });
+        contexts.push_back(context);
+    }
+    std::vector<std::string> expected;
+    for (const ttl::context &context : contexts) expected.push_back(outcome([&]() { return tmpl->evaluate(context); }));
+    ttl::thread_pool pool(3);
+    for (ttl::thread_pool *threads : { (ttl::thread_pool *)nullptr, &pool })
+    {
+        std::vector<std::string> results;
+        tmpl->evaluate_batch(contexts, [&](std::size_t index, std::string_view output, std::exception_ptr error)
+        {
+            if (index != results.size()) results.push_back("out of order");
+            else if (!error) results.push_back(std::string(output));
+            else results.push_back(outcome([&]() -> std::string { std::rethrow_exception(error); }));
+        }, threads);
+        check(results == expected, threads ? "parallel batch render" : "batch render");
+    }
+}
+
+void test_chunked_rendering()
+{
+    ttl::context context = sample_context();
+    for (const char *sample : samples)
+    {
+        ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(sample);
+        std::string expected = outcome([&]() { return tmpl->execute(context); });
+        for (std::size_t chunk_size : { 1, 7, 64 })
+        {
+            bool bounded = true;
+            std::string result = outcome([&]()
+            {
+                ttl::chunked_renderer renderer(*tmpl, context, chunk_size);
+                std::string ret;
+                for (std::string_view chunk = renderer.next(); !chunk.empty(); chunk = renderer.next())
+                {
+                    bounded = bounded && chunk.size() <= chunk_size && (chunk.size() == chunk_size || renderer.done());
+                    ret += chunk;
+                }
+                bounded = bounded && renderer.done();
+                return ret;
+            });
+            check(result == expected && bounded, "chunked render (" + std::to_string(chunk_size) + "): " + sample);
+        }
+    }
+}
+
+void test_template_files()
+{
+    ttl::context context = sample_context();
+    std::string path = "test_ttl_template.tmp";
+    for (const char *sample : samples)
+    {
+        std::ofstream(path, std::ios::binary) << sample;
+        ttl::tiny_template_ptr expected = ttl::tiny_template::parse(sample);
+        for (bool arena : { false, true })
+        {
+            ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse_file(path, ttl::parse_options{ arena });
+            check(tmpl->debug() == expected->debug() &&
+                  outcome([&]() { return tmpl->execute(context); }) == outcome([&]() { return expected->execute(context); }) &&
+                  outcome([&]() { return tmpl->evaluate(context); }) == outcome([&]() { return expected->evaluate(context); }),
+                  std::string("mapped template file: ") + sample);
+        }
+    }
+
+    // hot swap, by renaming a new version over the file
+    std::ofstream(path, std::ios::binary) << "version {$name}";
+    ttl::template_file file(path);
+    ttl::tiny_template_ptr before = file.get();
+    check(!file.refresh() && file.get() == before, "unchanged template file");
+    std::ofstream(path + ".new", std::ios::binary) << "new version {$name}{#if $name == 'arthur'}!{#end}";
+    std::rename((path + ".new").c_str(), path.c_str());
+    check(file.refresh() && file.get()->evaluate(context) == "new version arthur!" && before->evaluate(context) == "version arthur", "swapped template file");
+    std::remove(path.c_str());
+    check(outcome([&]() { return std::to_string(file.refresh()); }) == "error: cannot read template file 'test_ttl_template.tmp'" &&
+          file.get()->evaluate(context) == "new version arthur!", "removed template file");
+}
+
+void test_optimizer()
+{
+    ttl::context context = sample_context();
+    for (const char *sample : samples)
+    {
+        ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(sample);
+        ttl::parse_options options;
+        options.optimize = true;
+        ttl::tiny_template_ptr optimized = ttl::tiny_template::parse(sample, options);
+        std::string expected = outcome([&]() { return tmpl->evaluate(context); });
+        check(outcome([&]() { return optimized->evaluate(context); }) == expected &&
+              outcome([&]() { return optimized->execute(context); }) == expected, std::string("optimized template: ") + sample);
+    }
+    struct { const char *source; const char *debug; std::size_t removed; } cases[] =
+    {
+        { "plain", "plain", 1 },
+        { "a{#if 'x' == 'x'}b{#else}c{#end}d", "abd", 10 },
+        { "a{#if 'x' == 'y'}b{#elseif $name}{$name}{#else}{#end}", "a{#if $name}{$name}{#end}", 7 },
+        { "{#if 'a' == 'b'}b{#elseif 'z'}{$name}{#elseif $x}c{#end}", "{$name}", 12 },
+        { "{#if 'x' == 'y'}b{#end}", "", 6 },
+        { "{#if '2' < '10'}b{#end}", "", 6 },
+        { "{#join $i in $items}{#if $i}<{$i}>{#else}{#end}{#end}", "{#join $i in $items}{#if $i}<{$i}>{#end}{#end}", 3 },
+    };
+    for (auto &c : cases)
+    {
+        ttl::ast::node_ptr root = ttl::ast::node::parse(c.source);
+        std::size_t removed = ttl::ast::node::optimize(root);
+        check(root->debug() == c.debug && removed == c.removed,
+              std::string("optimizer: ") + c.source);
+    }
+}
+
+void test_generated_renderers()
+{
+    // generated from test_templates/report.ttl, by the Makefile
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse_file("test_templates/report.ttl");
+    std::vector<ttl::context> contexts(4, sample_context());
+    contexts[1]["name"] = "<b>\"zaphod\" & co</b>";
+    contexts[1]["count"] = ttl::lazy([]() { return ttl::value(7); });
+    contexts[1]["items"] = ttl::vector( { "a b", "foo", ttl::value(), 2.5 } );
+    contexts[2].erase("rows");
+    contexts[3] = ttl::context();
+    for (const ttl::context &context : contexts)
+    {
+        check(outcome([&]() { return render_report(context); }) == outcome([&]() { return tmpl->evaluate(context); }),
+              "generated renderer: " + outcome([&]() { return tmpl->evaluate(context); }).substr(0, 40));
+    }
+    // generated from samples[], by the Makefile
+    ttl::context context = sample_context();
+    check(std::size(sample_renderers) == std::size(samples), "generated samples");
+    check(ttl::generate_cpp(*ttl::tiny_template::parse("{#if $flag}{#end}"), "render").find("(ttl::sink &, const ttl::context &ctx)") != std::string::npos,
+          "generated code without output");
+    for (std::size_t i = 0; i < std::size(samples); ++i)
+    {
+        std::string expected = outcome([&]() { return ttl::tiny_template::parse(samples[i])->evaluate(context); });
+        check(outcome([&]() { return sample_renderers[i](context); }) == expected, std::string("generated sample: ") + samples[i]);
+    }
+}
+
+#ifdef TTL_PROFILE
+void test_profile()
+{
+    ttl::context context = sample_context();
+    context["big"] = ttl::lazy([]() { return ttl::value(std::string(100, 'x')); });
+    std::string source = "head\n{#join $item in $items with ', '}{$item}{#if $item == 'foo'}!{#end}{#end}\n{$big}";
+    ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse(source);
+    ttl::render_profile profile;
+    std::string output = tmpl->evaluate(context, profile);
+    check(output == tmpl->evaluate(context), "profiled render");
+    auto find = [&](const std::string &label)
+    {
+        for (const ttl::render_profile::entry &e : profile.entries()) if (e.label == label) return e;
+        return ttl::render_profile::entry();
+    };
+    ttl::render_profile::entry root = find("sequence"), join = find("#join $item in $items"), item = find("{$item}"), big = find("{$big}");
+    check(root.line == 1 && root.calls == 1 && root.bytes == output.size() && root.inclusive >= root.exclusive, "profiled root");
+    check(join.line == 2 && join.calls == 1 && join.bytes == 14 && join.inclusive >= item.inclusive, "profiled join");
+    check(item.line == 2 && item.offset == 38 && item.calls == 3 && item.bytes == 9, "profiled reference");
+    // allocations are counted if ttl_profile_alloc.cpp is linked in, as by the Makefile
+    std::size_t allocations = ttl::profiling::allocations;
+    std::unique_ptr<std::string> probe(new std::string("probe"));
+    bool counted = ttl::profiling::allocations != allocations;
+    check(find("#if $item == foo").calls == 3 && big.line == 3 && big.allocations >= counted && item.allocations == 0, "profiled nodes");
+    std::ostringstream flame, report;
+    profile.flame_graph(flame);
+    profile.report(report);
+    check(flame.str().find("sequence (line 1);#join $item in $items (line 2);sequence (line 2);{$item} (line 2) ") != std::string::npos &&
+          report.str().find("#if $item == foo\n") != std::string::npos, "profile export");
+    const ttl::parse_metrics &metrics = tmpl->parse_profile();
+    check(metrics.source_size == source.size() && metrics.nodes == 16 && metrics.parse.count() > 0, "parse metrics");
+}
+#endif
+
 int main(int argv, char* argc[])
 {
     test1();
 //    test2();
-    return 0;
+    test_sinks();
+    test_nested_joins();
+    test_indexed_context();
+    test_values();
+    test_template_cache();
+    test_concurrent_rendering();
+    test_bytecode();
+    test_parsers();
+    test_comparisons();
+    test_escaping();
+    test_size_hints();
+    test_json();
+    test_from_json();
+    test_arenas();
+    test_lazy_values();
+    test_dependencies();
+    test_incremental_rendering();
+    test_parallel_join();
+    test_batch_rendering();
+    test_chunked_rendering();
+    test_template_files();
+    test_optimizer();
+    test_generated_renderers();
+#ifdef TTL_PROFILE
+    test_profile();
+#endif
+    if (failures) std::cerr << failures << " test(s) failed" << std::endl;
+    return failures ? 1 : 0;
 }
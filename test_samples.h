@@ -0,0 +1,21 @@
+#pragma once
+
+// templates shared by the differential tests, and compiled ahead of time by gen_samples
+const char *samples[] =
+{
+    "",
+    "plain text only",
+    "{$name}",
+    "hello {#if $name}{$name}{#elseif $surname}{$surname}{#else}John{#end}!",
+    "{#if $missing}a{#elseif $empty}b{#else}c{#end}{#if $flag}d{#end}{#if $zero}e{#end}",
+    "{#if $name == 'arthur'}yes{#else}no{#end} {#if $count == '42'}42{#end} {#if $name == $surname}same{#end}",
+    "{#join $item in $items with ', '}{$item}{#if $item == 'foo'}!{#end}{#end}",
+    "{#join $item in $items}[{$item}]{#end}{#join $item in $empty}never{#end}{#join $item in $name}<{$item}>{#end}",
+    "{#join $row in $rows with $sep}{$row.id}:{#join $tag in $row.tags with '/'}{$row.id}{$tag}{#end}{#end}",
+    "{#join $name in $items with ' '}{$name}{#end} {$name}",
+    "{$user.address.city}, {$count} {$ratio} {$flag}",
+    "{#if 'literal'}text{#end}",
+    "{#if $count > '9'}gt{#end} {#if $ratio <= '0.25'}le{#end} {#if $name != $surname}ne{#end} {#if $name >= 'b'}ge{#end}",
+    "{$user.address.missing}",
+    "{$name|html} {$user.address.city|url} {$ratio|json}{$name|raw}",
+};
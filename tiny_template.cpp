@@ -22,22 +22,45 @@
 #endif
 
 #include <boost/algorithm/string/join.hpp>
+// define TTL_NO_SPIRIT to leave out the Spirit X3 grammar, and its compilation time
+#ifndef TTL_NO_SPIRIT
 #include <boost/fusion/include/at_c.hpp>
+#include <boost/fusion/include/std_pair.hpp>
 #include <boost/optional/optional_io.hpp>
 // uncomment to display parsing debugging infos
 //#define BOOST_SPIRIT_X3_DEBUG
 #include <boost/spirit/home/x3.hpp>
 #include <boost/tuple/tuple.hpp>
+#endif
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
 #include <exception>
+#include <forward_list>
+#include <fstream>
+#include <iomanip>
 #include <memory>
-#include <sstream>
+#include <memory_resource>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "tiny_template.h"
 
 // hack for windows
-#ifdef _WIN32
+#if defined(_WIN32) && !defined(TTL_NO_SPIRIT)
 #undef BOOST_SPIRIT_DEFINE_
 #undef BOOST_SPIRIT_DEFINE
 
@@ -68,403 +91,3395 @@
 #define LOG(op)
 #endif
 
+#ifdef TTL_PROFILE
+namespace ttl
+{
+	namespace profiling
+	{
+		thread_local std::size_t allocations = 0;
+	}
+}
+#endif
+
 namespace ttl
 {
+#ifndef TTL_NO_SPIRIT
 	namespace x3 = boost::spirit::x3;
+#endif
 
-	// utility
+	// values
 
-	void to_json_map(const map &m, std::ostream &out);
-	void to_json_array(const vector &v, std::ostream &out);
-	
-	void to_json_array(const vector &v, std::ostream &out)
+	value::value(const vector &v) : tag(kind::vector) { vect = new vector(v); }
+	value::value(vector &&v) : tag(kind::vector) { vect = new vector(std::move(v)); }
+	value::value(const map &m) : tag(kind::map) { object = new map(m); }
+	value::value(map &&m) : tag(kind::map) { object = new map(std::move(m)); }
+	value::value(provider_ptr p) : tag(kind::lazy) { source = new provider_ptr(std::move(p)); }
+
+	value::value(const any_vector &v) : tag(kind::vector)
+	{
+		vect = new vector();
+		vect->reserve(v.size());
+		for (const boost::any &item : v) vect->push_back(value(item));
+	}
+
+	value::value(const any_map &m) : tag(kind::map)
+	{
+		object = new map();
+		for (auto &pair : m) object->emplace_hint(object->end(), pair.first, value(pair.second));
+	}
+
+	value::value(const boost::any &any) : tag(kind::null)
 	{
-		out << '[';
-		bool first = true;
-		for (auto &item : v)
+		const std::type_info &type = any.type();
+		if (any.empty()) return;
+		else if (type == typeid(std::string)) *this = value(boost::any_cast<const std::string &>(any));
+		else if (type == typeid(const char *)) *this = value(boost::any_cast<const char *>(any));
+		else if (type == typeid(char *)) *this = value(boost::any_cast<char *>(any));
+		else if (type == typeid(bool)) *this = value(boost::any_cast<bool>(any));
+		else if (type == typeid(int)) *this = value(boost::any_cast<int>(any));
+		else if (type == typeid(unsigned int)) *this = value(boost::any_cast<unsigned int>(any));
+		else if (type == typeid(long)) *this = value(boost::any_cast<long>(any));
+		else if (type == typeid(unsigned long)) *this = value(boost::any_cast<unsigned long>(any));
+		else if (type == typeid(long long)) *this = value(boost::any_cast<long long>(any));
+		else if (type == typeid(unsigned long long)) *this = value(boost::any_cast<unsigned long long>(any));
+		else if (type == typeid(float)) *this = value(boost::any_cast<float>(any));
+		else if (type == typeid(double)) *this = value(boost::any_cast<double>(any));
+		else if (type == typeid(any_vector)) *this = value(boost::any_cast<const any_vector &>(any));
+		else if (type == typeid(any_map)) *this = value(boost::any_cast<const any_map &>(any));
+		else if (type == typeid(vector)) *this = value(boost::any_cast<const vector &>(any));
+		else if (type == typeid(map)) *this = value(boost::any_cast<const map &>(any));
+		else if (type == typeid(value)) *this = boost::any_cast<const value &>(any);
+		else throw evaluation_error("invalid type");
+	}
+
+	void value::set_string(const char *data, std::size_t size)
+	{
+		tag = kind::string;
+		if (size <= small_capacity)
 		{
-			if (first) first = false;
-			else out << ',';
-			const std::string *str = boost::any_cast<std::string>(&item);
-			if (str) out << '"' << *str << '"';
-			else
-			{
-                const char * const* chars = boost::any_cast<const char*>(&item);
-                if (chars) out << '"' << *str << '"';
-                else
-                {
-                    const vector *vect = boost::any_cast<vector>(&item);
-                    if (vect) to_json_array(*vect, out);
-                    else
-                    {
-                        const map *m = boost::any_cast<map>(&item);
-                        if (m) to_json_map(*m, out);
-                        else throw evaluation_error("invalid type");
-                    }
-                }
-			}
+			if (size) std::memcpy(small, data, size);
+			small_size = static_cast<unsigned char>(size);
+		}
+		else
+		{
+			char *heap = new char[size];
+			std::memcpy(heap, data, size);
+			chars.data = heap;
+			chars.size = size;
+			small_size = small_capacity + 1;
 		}
-		out << ']';
 	}
-	
-	void to_json_map(const map &m, std::ostream &out)
+
+	void value::copy(const value &other)
 	{
-		out << '{';
-		bool first = true;
-		for (auto &pair : m)
+		switch (other.tag)
 		{
-			if (first) first = false;
-			else out << ',';
-			out << '"' << pair.first << "\":";
-			const std::string *str = boost::any_cast<std::string>(&pair.second);
-			if (str) out << '"' << *str << '"';
-			else
+			case kind::string:
+				if (other.is_small())
+				{
+					std::memcpy(small, other.small, other.small_size);
+					small_size = other.small_size;
+					tag = kind::string;
+				}
+				else set_string(other.chars.data, other.chars.size);
+				return;
+			case kind::vector: vect = new vector(*other.vect); break;
+			case kind::map: object = new map(*other.object); break;
+			case kind::lazy: source = new provider_ptr(*other.source); break;
+			default: chars = other.chars; break; // trivially copyable alternatives
+		}
+		tag = other.tag;
+	}
+
+	void value::steal(value &other)
+	{
+		std::memcpy(static_cast<void *>(&chars), &other.chars, sizeof(chars)); // the largest alternative
+		small_size = other.small_size;
+		tag = other.tag;
+		other.tag = kind::null;
+	}
+
+	void value::clear()
+	{
+		switch (tag)
+		{
+			case kind::string: if (!is_small()) delete[] chars.data; break;
+			case kind::vector: delete vect; break;
+			case kind::map: delete object; break;
+			case kind::lazy: delete source; break;
+			default: break;
+		}
+		tag = kind::null;
+	}
+
+	std::string_view value::as_string() const
+	{
+		switch (tag)
+		{
+			case kind::string: return is_small() ? std::string_view(small, small_size) : std::string_view(chars.data, chars.size);
+			case kind::string_view: return std::string_view(chars.data, chars.size);
+			default: throw evaluation_error("not a string");
+		}
+	}
+
+	std::int64_t value::as_integer() const
+	{
+		if (tag != kind::integer) throw evaluation_error("not an integer");
+		return integer;
+	}
+
+	double value::as_real() const
+	{
+		if (tag == kind::integer) return static_cast<double>(integer);
+		if (tag != kind::real) throw evaluation_error("not a number");
+		return real;
+	}
+
+	bool value::as_boolean() const
+	{
+		if (tag != kind::boolean) throw evaluation_error("not a boolean");
+		return boolean;
+	}
+
+	const vector & value::as_vector() const
+	{
+		if (tag != kind::vector) throw evaluation_error("not a vector");
+		return *vect;
+	}
+
+	vector & value::as_vector()
+	{
+		if (tag != kind::vector) throw evaluation_error("not a vector");
+		return *vect;
+	}
+
+	const map & value::as_map() const
+	{
+		if (tag != kind::map) throw evaluation_error("not a map");
+		return *object;
+	}
+
+	map & value::as_map()
+	{
+		if (tag != kind::map) throw evaluation_error("not a map");
+		return *object;
+	}
+
+	const provider & value::as_provider() const
+	{
+		if (tag != kind::lazy) throw evaluation_error("not a lazy value");
+		return **source;
+	}
+
+	const value * value::find(const std::string &key) const
+	{
+		if (tag != kind::map) return nullptr;
+		map::const_iterator it = object->find(key);
+		return it == object->end() ? nullptr : &it->second;
+	}
+
+	bool value::test() const
+	{
+		switch (tag)
+		{
+			case kind::null: return false;
+			case kind::string: return small_size != 0; // heap strings are never empty
+			case kind::string_view: return chars.size != 0;
+			case kind::integer: return integer != 0;
+			case kind::real: return real != 0.0;
+			case kind::boolean: return boolean;
+			case kind::vector: return !vect->empty();
+			case kind::map: return !object->empty();
+			case kind::lazy: return (*source)->resolve().test();
+		}
+		return false;
+	}
+
+	std::string value::to_string() const
+	{
+		switch (tag)
+		{
+			case kind::null: return std::string();
+			case kind::string:
+			case kind::string_view: return std::string(as_string());
+			case kind::integer: return std::to_string(integer);
+			case kind::real:
 			{
-                const char * const* chars = boost::any_cast<const char*>(&pair.second);
-                if (chars) out << '"' << *str << '"';
-                else
-                {
-                    const vector *vect = boost::any_cast<vector>(&pair.second);
-                    if (vect) to_json_array(*vect, out);
-                    else
-                    {
-                        const map * submap = boost::any_cast<map>(&pair.second);
-                        if (submap) to_json_map(*submap, out);
-                        else throw evaluation_error("invalid type");
-                    }
-                }
+				char buffer[32];
+				std::to_chars_result res = std::to_chars(buffer, buffer + sizeof(buffer), real);
+				return std::string(buffer, res.ptr);
 			}
+			case kind::boolean: return boolean ? "true" : "false";
+			case kind::lazy: return (*source)->resolve().to_string();
+			default: throw evaluation_error("wrong type");
 		}
-		out << '}';
 	}
-	
-	std::string to_json(const context &ctx)
+
+	context make_context(const any_map &m)
 	{
-		std::ostringstream oss;
-		to_json_map(ctx, oss);
-		return oss.str();
+		return value(m).as_map();
 	}
-	
-	// AST
 
-	namespace ast
+	provider_ptr lazy(std::function<value()> compute, bool memoize)
 	{
-		// global empty string value as boost::any
-		boost::any empty_string = std::string();
+		struct callback_provider : provider
+		{
+			callback_provider(std::function<value()> compute, bool memoized) : compute(compute), memoized(memoized) {}
+			virtual value resolve() const { return compute(); }
+			virtual bool memoize() const { return memoized; }
+			std::function<value()> compute;
+			bool memoized;
+		};
+		return std::make_shared<callback_provider>(compute, memoize);
+	}
 
-		struct parent_node : node
+	// utility
+
+	namespace scanning
+	{
+		// consumes lit if the input at pos starts with it
+		inline bool match(const char *&pos, const char *end, const char *lit, std::size_t len)
 		{
-			template <typename T> parent_node(std::vector<T> &v)
+			if (static_cast<std::size_t>(end - pos) < len || std::memcmp(pos, lit, len)) return false;
+			pos += len;
+			return true;
+		}
+	}
+
+	namespace escaping
+	{
+		// whether a char needs escaping
+		template <escape_mode Mode> bool special(unsigned char c)
+		{
+			if constexpr (Mode == escape_mode::html) return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'';
+			else if constexpr (Mode == escape_mode::json) return c == '"' || c == '\\' || c < 0x20;
+			else if constexpr (Mode == escape_mode::url)
+				return !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~');
+			else return false;
+		}
+
+#ifdef __SSE2__
+		// the same, over 16 chars at once
+		template <escape_mode Mode> __m128i special(__m128i chunk)
+		{
+			auto is = [&](char c) { return _mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)); };
+			// signed comparisons: chars past 0x7F are negative, thus out of all ranges
+			auto in = [&](char low, char high)
 			{
-				for (T &t : v)
-				{
-					children.push_back(boost::get<node_ptr>(t));
-				}
-			}
-			virtual ~parent_node() {}
-			virtual std::string evaluate(const map &params)
+				return _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8(low - 1)), _mm_cmplt_epi8(chunk, _mm_set1_epi8(high + 1)));
+			};
+			if constexpr (Mode == escape_mode::html)
+				return _mm_or_si128(_mm_or_si128(_mm_or_si128(is('&'), is('<')), _mm_or_si128(is('>'), is('"'))), is('\''));
+			else if constexpr (Mode == escape_mode::json)
 			{
-				std::string ret;
-				for (node_ptr &node : children) ret += node->evaluate(params);
-				return ret;
+				const __m128i control = _mm_set1_epi8(0x1F);
+				return _mm_or_si128(_mm_or_si128(is('"'), is('\\')),
+					_mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control)); // unsigned chunk <= 0x1F
 			}
-			virtual std::string debug()
+			else if constexpr (Mode == escape_mode::url)
 			{
-				std::string ret;
-				for (node_ptr &node : children) ret += node->debug();
-				return ret;
+				__m128i unreserved = _mm_or_si128(_mm_or_si128(_mm_or_si128(in('a', 'z'), in('A', 'Z')), _mm_or_si128(in('0', '9'), is('-'))),
+					_mm_or_si128(_mm_or_si128(is('_'), is('.')), is('~')));
+				return _mm_andnot_si128(unreserved, _mm_set1_epi8(-1));
 			}
-            virtual bool test(const map &) { throw evaluation_error("parent_node cannot be tested"); }
-			std::vector<node_ptr> children;
-		};
+			else return _mm_setzero_si128();
+		}
+#endif
 
-		struct text : node
-		{
-			text(const std::string s) : value(s) {}
-			virtual ~text() {}
-			virtual std::string evaluate(const map &params) { return value; }
-			virtual std::string debug() { return value; }
-            virtual bool test(const map &) { return !value.empty(); }
-			std::string value;
-		};
-		
-		struct reference : node
+		// position of the first char needing escaping in [begin, end)
+		template <escape_mode Mode> const char * find(const char *begin, const char *end)
 		{
-			reference(const std::vector<std::string> &vect) : identifiers(vect) {}
-			virtual ~reference() {}
-
-			virtual std::string evaluate(const map &params)
+#ifdef __SSE2__
+			for (; end - begin >= 16; begin += 16)
 			{
-                std::string ret;
-				const std::string * str = boost::any_cast<std::string>(&resolve(params));
-                if (str) { ret = *str; }
-                else
-                {
-                    const char * const* chars = boost::any_cast<const char*>(&resolve(params));
-                    if (chars) { ret = *chars; }
-                    else throw evaluation_error("wrong type");
-                }
-                return ret;
+				int mask = _mm_movemask_epi8(special<Mode>(_mm_loadu_si128(reinterpret_cast<const __m128i *>(begin))));
+				if (mask) return begin + __builtin_ctz(mask);
+			}
+#endif
+			for (; begin != end; ++begin)
+			{
+				if (special<Mode>(static_cast<unsigned char>(*begin))) return begin;
 			}
+			return end;
+		}
 
-			const boost::any & resolve(const map &params)
+		// escape sequence of a char needing escaping; the buffer needs 6 chars
+		template <escape_mode Mode> std::string_view replacement(unsigned char c, char *buffer)
+		{
+			if constexpr (Mode == escape_mode::html)
 			{
-				const map *p = &params;
-				map::const_iterator it;
-				for (int i = 0; i < identifiers.size(); ++i)
+				switch (c)
 				{
-					it = p->find(identifiers[i]);
-					if (it == p->end())
-					{
-						if (i == identifiers.size() - 1) return empty_string; // empty string for empty references
-						throw evaluation_error("parameter '" + identifiers[i] + "' not found");
-					}
-					if (i == identifiers.size() - 1) break;
-					p = &boost::any_cast<const map &>(it->second);
+					case '&': return "&amp;";
+					case '<': return "&lt;";
+					case '>': return "&gt;";
+					case '"': return "&quot;";
+					default: return "&#39;";
 				}
-				return it->second;
 			}
-			
-			virtual std::string debug() { return "{" + debug_inner() + "}"; }
-			std::string debug_inner() { return "$" + boost::join(identifiers, "."); }
-
-			virtual bool test(const map &params)
-			{
-				boost::any prop;
-				try { prop = resolve(params); } catch (std::exception &) { return false; }
-				const std::string *value = boost::any_cast<std::string>(&prop);
-				if (value) return !value->empty();  /* empty strings are false */
-                const char** chars = boost::any_cast<const char*>(&prop);
-                if (chars) return *chars && **chars; /* empty and null char* strings are false */
-				const map *m = boost::any_cast<const map>(&prop);
-				if (m) return !m->empty();
-				const vector *v = boost::any_cast<const vector>(&prop);
-				if (v) return !v->empty();
-				throw evaluation_error("invalid type");
+			else if constexpr (Mode == escape_mode::json)
+			{
+				static const char hex[] = "0123456789abcdef";
+				switch (c)
+				{
+					case '"': return "\\\"";
+					case '\\': return "\\\\";
+					case '\b': return "\\b";
+					case '\f': return "\\f";
+					case '\n': return "\\n";
+					case '\r': return "\\r";
+					case '\t': return "\\t";
+					default:
+						std::memcpy(buffer, "\\u00", 4);
+						buffer[4] = hex[c >> 4];
+						buffer[5] = hex[c & 0xF];
+						return std::string_view(buffer, 6);
+				}
 			}
-			std::vector<std::string> identifiers;
-		};
+			else
+			{
+				static const char hex[] = "0123456789ABCDEF";
+				buffer[0] = '%';
+				buffer[1] = hex[c >> 4];
+				buffer[2] = hex[c & 0xF];
+				return std::string_view(buffer, 3);
+			}
+		}
 
-        struct condition : node
-        {
-			condition() {}
-            virtual ~condition() {}
-            virtual std::string evaluate(const map &) { throw evaluation_error("condition cannot be evaluated"); }
-            virtual std::string operator_string() = 0;
-        };
-    
-        struct binary_operator : condition
-        {
-			binary_operator(node_ptr left_, node_ptr right_)
+		// copies clean runs at once, and escape sequences in between
+		template <escape_mode Mode, typename Output> void write(Output out, std::string_view str)
+		{
+			char buffer[6];
+			const char *pos = str.data(), *end = pos + str.size();
+			for (;;)
 			{
-                left = left_;
-                right = right_;
-            }
-            virtual ~binary_operator() {}
-            virtual std::string debug()
-            {
-                return ( left->get<reference>() ? left->get<reference>()->debug_inner() : left->debug() ) + " " +
-                        operator_string() + " " +
-                        ( right->get<reference>() ? right->get<reference>()->debug_inner() : right->debug() );
-            }
-			virtual bool test(const map &params)
-            {
-                std::string left_value = left->evaluate(params);
-                std::string right_value = right->evaluate(params);
-                return apply_operator(left_value, right_value);
-            }
-            virtual bool apply_operator(const std::string &left_value, const std::string &right_value) = 0;
-            node_ptr left;
-            node_ptr right;
-        };
+				const char *special = find<Mode>(pos, end);
+				if (special != pos) out(pos, special - pos);
+				if (special == end) break;
+				std::string_view seq = replacement<Mode>(static_cast<unsigned char>(*special), buffer);
+				out(seq.data(), seq.size());
+				pos = special + 1;
+			}
+		}
+	}
 
-        struct equals_operator : binary_operator
-        {
-            equals_operator(node_ptr left, node_ptr right) : binary_operator(left, right)
-            {
-            }
+	void escape(sink &out, std::string_view str, escape_mode mode)
+	{
+		auto output = [&](const char *data, std::size_t size) { out.write(data, size); };
+		switch (mode)
+		{
+			case escape_mode::none: out.write(str.data(), str.size()); break;
+			case escape_mode::html: escaping::write<escape_mode::html>(output, str); break;
+			case escape_mode::json: escaping::write<escape_mode::json>(output, str); break;
+			case escape_mode::url: escaping::write<escape_mode::url>(output, str); break;
+		}
+	}
 
-            virtual std::string operator_string() { return "=="; }
-            virtual bool apply_operator(const std::string &left_value, const std::string &right_value)
-            {
-                return left_value == right_value;
-            }
-        };
-    
-		struct if_directive : node
+	namespace json
+	{
+		const char * find_escape(const char *begin, const char *end) { return escaping::find<escape_mode::json>(begin, end); }
+
+		// JSON writer, buffering its output in a string, flushed to the sink (if any) past a threshold
+		class writer
 		{
-			template <typename tuple> if_directive(tuple & t)
+		public:
+			writer(std::string &buffer, sink *out, json_style style) : buffer(buffer), out(out), pretty(style == json_style::pretty), depth(0) {}
+			~writer() { flush(); }
+
+			void write(const value &val)
 			{
-				using boost::fusion::at_c;
-				condition_nodes.push_back(at_c<0>(t));
-				part_nodes.push_back(at_c<1>(t));
-				for (auto &elseif : at_c<2>(t))
+				switch (val.type())
 				{
-					condition_nodes.push_back(at_c<0>(elseif));
-					part_nodes.push_back(at_c<1>(elseif));
+					case value::kind::null: buffer += "null"; break;
+					case value::kind::string:
+					case value::kind::string_view: write_string(val.as_string()); break;
+					case value::kind::integer: write_number(val.as_integer()); break;
+					case value::kind::real:
+						if (std::isfinite(val.as_real())) write_number(val.as_real());
+						else buffer += "null";
+						break;
+					case value::kind::boolean: buffer += val.as_boolean() ? "true" : "false"; break;
+					case value::kind::vector: write(val.as_vector()); break;
+					case value::kind::map: write(val.as_map()); break;
+					case value::kind::lazy: write(val.as_provider().resolve()); return;
 				}
-                
-				if (at_c<3>(t)) part_nodes.push_back(*at_c<3>(t));
-			}
-			virtual ~if_directive() {}
-			virtual std::string evaluate(const map &params)
-			{
-				if (!condition_nodes.size() || part_nodes.size() < condition_nodes.size() || part_nodes.size() > condition_nodes.size() + 1) throw evaluation_error("malformed #if directive");
-                int cond = 0;
-                for (; cond < condition_nodes.size(); ++cond)
-                {
-                    if (condition_nodes[cond]->test(params)) return part_nodes[cond]->evaluate(params);
-                }
-                return part_nodes.size() > cond ? part_nodes[cond]->evaluate(params) : std::string();
-			}
-			virtual std::string debug()
-			{
-                std::string dbg;
-                int cond = 0;
-                for (; cond < condition_nodes.size(); ++cond)
-                {
-                    if (cond == 0) dbg = "{#if "; else dbg += "{#elseif ";
-                    reference* ref = condition_nodes[cond]->get<reference>();
-					std::string cond_string;
-                    if (ref) cond_string = ref->debug_inner();
-                    else cond_string = condition_nodes[cond]->debug();
-                    dbg += cond_string + "}" + part_nodes[cond]->debug();
-                }
-                if (part_nodes.size() > cond) dbg + "{#else}" + part_nodes[cond]->debug();
-                dbg += "{#end}";
-                return dbg;
+				if (out && buffer.size() >= flush_threshold) flush();
 			}
-            virtual bool test(const map &) { throw evaluation_error("#if directive cannot be tested"); }
-			std::vector<node_ptr> condition_nodes;
-            std::vector<node_ptr> part_nodes;
-		};
-		
-		struct join_directive : node
-		{
-			template <typename tuple> join_directive(tuple & t)
+
+			void write(const vector &v)
 			{
-				using boost::fusion::at_c;
-				iterator = at_c<0>(t);
-				if (!iterator->get<reference>() || iterator->get<reference>()->identifiers.size() != 1)
-					throw parsing_error("malformed #join directive");
-				collection = at_c<1>(t);
-				if (at_c<2>(t)) separator = *at_c<2>(t);
-				content = at_c<3>(t);
+				buffer += '[';
+				++depth;
+				for (vector::const_iterator item = v.begin(); item != v.end(); ++item)
+				{
+					if (item != v.begin()) buffer += ',';
+					newline();
+					write(*item);
+				}
+				--depth;
+				if (!v.empty()) newline();
+				buffer += ']';
 			}
-			virtual ~join_directive() {}
-			virtual std::string evaluate(const map &params)
+
+			void write(const map &m)
 			{
-				std::string ret;
-				std::string itname = iterator->get<reference>()->identifiers[0];
-				const boost::any & values = collection->get<reference>()->resolve(params);
-				const vector *objects = boost::any_cast<const vector>(&values);
-				vector fallback_vector;
-				if (!objects)
+				buffer += '{';
+				++depth;
+				for (map::const_iterator pair = m.begin(); pair != m.end(); ++pair)
 				{
-					fallback_vector.push_back(values);
-					objects = &fallback_vector;
+					if (pair != m.begin()) buffer += ',';
+					newline();
+					write_string(pair->first);
+					buffer += pretty ? ": " : ":";
+					write(pair->second);
 				}
-				map loop_params(params);
-				bool first = true;
-				for (boost::any const &value : *objects)
+				--depth;
+				if (!m.empty()) newline();
+				buffer += '}';
+			}
+
+			void flush()
+			{
+				if (out && !buffer.empty())
 				{
-					if (first) first = false;
-					else if (separator) ret += separator->evaluate(params);						
-					loop_params[itname] = value;
-					ret += content->evaluate(loop_params);
+					out->write(buffer.data(), buffer.size());
+					buffer.clear();
 				}
-				return ret;
 			}
 
-            virtual bool test(const map &) { throw evaluation_error("#join directive cannot be tested"); }
-            
-			virtual std::string debug()
+		private:
+			static const std::size_t flush_threshold = 4096;
+
+			void newline()
 			{
-				return "{#join $" + iterator->get<reference>()->identifiers[0] + " in $" + boost::join(collection->get<reference>()->identifiers, ".") +
-					( separator ? " with '" + separator->debug() + "'" : std::string() ) + "}" + content->debug() + "{#end}";
+				if (!pretty) return;
+				buffer += '\n';
+				buffer.append(depth * 2, ' ');
 			}
-			
-			node_ptr iterator;	
-			node_ptr collection;
-			node_ptr separator;
-			node_ptr content;
+
+			template <typename Number> void write_number(Number number)
+			{
+				char chars[32];
+				std::to_chars_result res = std::to_chars(chars, chars + sizeof(chars), number);
+				buffer.append(chars, res.ptr);
+			}
+
+			void write_string(std::string_view str)
+			{
+				buffer += '"';
+				escaping::write<escape_mode::json>([this](const char *data, std::size_t size) { buffer.append(data, size); }, str);
+				buffer += '"';
+			}
+
+			std::string &buffer;
+			sink *out;
+			bool pretty;
+			std::size_t depth;
+		};
+
+		// JSON reader: a recursive descent parser, building arrays on a shared stack of values
+		// so that each vector gets allocated once, at its final size
+		class reader
+		{
+		public:
+			reader(std::string_view json, json_mode mode) : begin(json.data()), pos(begin), end(begin + json.size()), borrow(mode == json_mode::borrow) {}
+
+			context parse()
+			{
+				skip_spaces();
+				if (pos == end || *pos != '{') error("object expected");
+				value root = parse_value(0);
+				skip_spaces();
+				if (pos != end) error("unexpected trailing characters");
+				return std::move(root.as_map());
+			}
+
+		private:
+			static const int max_depth = 512;
+
+			[[noreturn]] void error(const std::string &message)
+			{
+				throw parsing_error("json " + message + " at offset " + std::to_string(pos - begin));
+			}
+
+			void skip_spaces()
+			{
+				while (pos != end && (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t')) ++pos;
+			}
+
+			void expect(char c)
+			{
+				skip_spaces();
+				if (pos == end || *pos != c) error(std::string("'") + c + "' expected");
+				++pos;
+			}
+
+			bool literal(const char *lit, std::size_t len) { return scanning::match(pos, end, lit, len); }
+
+			value parse_value(int depth)
+			{
+				if (depth > max_depth) error("nesting too deep");
+				skip_spaces();
+				if (pos == end) error("value expected");
+				switch (*pos)
+				{
+					case '{': return parse_object(depth);
+					case '[': return parse_array(depth);
+					case '"': return parse_string();
+					case 't': if (literal("true", 4)) return value(true); break;
+					case 'f': if (literal("false", 5)) return value(false); break;
+					case 'n': if (literal("null", 4)) return value(); break;
+					default: return parse_number();
+				}
+				error("invalid literal");
+			}
+
+			value parse_object(int depth)
+			{
+				++pos;
+				map object;
+				skip_spaces();
+				if (pos != end && *pos == '}')
+				{
+					++pos;
+					return value(std::move(object));
+				}
+				for (;;)
+				{
+					skip_spaces();
+					if (pos == end || *pos != '"') error("key expected");
+					std::string key;
+					parse_string(key);
+					expect(':');
+					object[std::move(key)] = parse_value(depth + 1);
+					skip_spaces();
+					if (pos != end && *pos == ',') ++pos;
+					else break;
+				}
+				expect('}');
+				return value(std::move(object));
+			}
+
+			value parse_array(int depth)
+			{
+				++pos;
+				std::size_t base = stack.size();
+				skip_spaces();
+				if (pos != end && *pos == ']') ++pos;
+				else
+				{
+					for (;;)
+					{
+						stack.push_back(parse_value(depth + 1));
+						skip_spaces();
+						if (pos != end && *pos == ',') ++pos;
+						else break;
+					}
+					expect(']');
+				}
+				vector array(std::make_move_iterator(stack.begin() + base), std::make_move_iterator(stack.end()));
+				stack.resize(base);
+				return value(std::move(array));
+			}
+
+			value parse_string()
+			{
+				const char *start = pos + 1;
+				const char *special = find_escape(start, end);
+				if (special != end && *special == '"')
+				{
+					// no escape sequence
+					pos = special + 1;
+					std::string_view str(start, special - start);
+					return borrow ? value(str) : value(std::string(str));
+				}
+				std::string str;
+				parse_string(str);
+				return value(str);
+			}
+
+			void parse_string(std::string &str)
+			{
+				++pos;
+				for (;;)
+				{
+					const char *special = find_escape(pos, end);
+					str.append(pos, special);
+					pos = special;
+					if (pos == end) error("unterminated string");
+					char c = *pos++;
+					if (c == '"') return;
+					if (c != '\\') error("control character in string");
+					if (pos == end) error("unterminated string");
+					switch (*pos++)
+					{
+						case '"': str += '"'; break;
+						case '\\': str += '\\'; break;
+						case '/': str += '/'; break;
+						case 'b': str += '\b'; break;
+						case 'f': str += '\f'; break;
+						case 'n': str += '\n'; break;
+						case 'r': str += '\r'; break;
+						case 't': str += '\t'; break;
+						case 'u': append_utf8(str, parse_code_point()); break;
+						default: error("invalid escape sequence");
+					}
+				}
+			}
+
+			unsigned parse_hex4()
+			{
+				if (end - pos < 4) error("invalid unicode escape");
+				unsigned code = 0;
+				for (int i = 0; i < 4; ++i, ++pos)
+				{
+					char c = *pos;
+					code <<= 4;
+					if (c >= '0' && c <= '9') code |= c - '0';
+					else if (c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+					else if (c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+					else error("invalid unicode escape");
+				}
+				return code;
+			}
+
+			unsigned parse_code_point()
+			{
+				unsigned code = parse_hex4();
+				if (code >= 0xD800 && code < 0xDC00)
+				{
+					// surrogate pair
+					if (!literal("\\u", 2)) error("invalid surrogate pair");
+					unsigned low = parse_hex4();
+					if (low < 0xDC00 || low >= 0xE000) error("invalid surrogate pair");
+					code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+				}
+				else if (code >= 0xDC00 && code < 0xE000) error("invalid surrogate pair");
+				return code;
+			}
+
+			static void append_utf8(std::string &str, unsigned code)
+			{
+				if (code < 0x80) str += static_cast<char>(code);
+				else if (code < 0x800)
+				{
+					str += static_cast<char>(0xC0 | (code >> 6));
+					str += static_cast<char>(0x80 | (code & 0x3F));
+				}
+				else if (code < 0x10000)
+				{
+					str += static_cast<char>(0xE0 | (code >> 12));
+					str += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+					str += static_cast<char>(0x80 | (code & 0x3F));
+				}
+				else
+				{
+					str += static_cast<char>(0xF0 | (code >> 18));
+					str += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+					str += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+					str += static_cast<char>(0x80 | (code & 0x3F));
+				}
+			}
+
+			value parse_number()
+			{
+				const char *start = pos;
+				if (pos != end && *pos == '-') ++pos;
+				const char *digits = pos;
+				while (pos != end && *pos >= '0' && *pos <= '9') ++pos;
+				if (pos == digits || (*digits == '0' && pos - digits > 1)) error("invalid number");
+				bool integral = true;
+				if (pos != end && *pos == '.')
+				{
+					integral = false;
+					const char *fraction = ++pos;
+					while (pos != end && *pos >= '0' && *pos <= '9') ++pos;
+					if (pos == fraction) error("invalid number");
+				}
+				if (pos != end && (*pos == 'e' || *pos == 'E'))
+				{
+					integral = false;
+					++pos;
+					if (pos != end && (*pos == '+' || *pos == '-')) ++pos;
+					const char *exponent = pos;
+					while (pos != end && *pos >= '0' && *pos <= '9') ++pos;
+					if (pos == exponent) error("invalid number");
+				}
+				if (integral)
+				{
+					std::int64_t integer;
+					std::from_chars_result res = std::from_chars(start, pos, integer);
+					if (res.ec == std::errc() && res.ptr == pos) return value(integer);
+					// out of range integers fall back to reals
+				}
+				double real;
+				std::from_chars_result res = std::from_chars(start, pos, real);
+				if (res.ec != std::errc() || res.ptr != pos) error("invalid number");
+				return value(real);
+			}
+
+			const char *begin;
+			const char *pos;
+			const char *end;
+			bool borrow;
+			std::vector<value> stack;
+		};
+
+	} // namespace json
+
+	context from_json(std::string_view json, json_mode mode)
+	{
+		return json::reader(json, mode).parse();
+	}
+
+	std::string to_json(const context &ctx, json_style style)
+	{
+		std::string ret;
+		json::writer(ret, nullptr, style).write(ctx);
+		return ret;
+	}
+
+	void to_json(sink &out, const context &ctx, json_style style)
+	{
+		std::string buffer;
+		json::writer(buffer, &out, style).write(ctx);
+	}
+
+	void to_json(sink &out, const value &val, json_style style)
+	{
+		std::string buffer;
+		json::writer(buffer, &out, style).write(val);
+	}
+
+	// symbols
+
+	std::size_t symbol_table::intern(const std::string &name)
+	{
+		std::map<std::string, std::size_t>::iterator it = ids.find(name);
+		if (it != ids.end()) return it->second;
+		ids[name] = names.size();
+		names.push_back(name);
+		return names.size() - 1;
+	}
+
+	std::size_t symbol_table::find(const std::string &name) const
+	{
+		std::map<std::string, std::size_t>::const_iterator it = ids.find(name);
+		return it == ids.end() ? npos : it->second;
+	}
+
+	// sinks
+
+	void buffer_sink::write(const char *data, std::size_t size)
+	{
+		if (length < capacity)
+		{
+			std::size_t room = capacity - length;
+			std::memcpy(buffer + length, data, size < room ? size : room);
+		}
+		length += size;
+	}
+	
+	// AST
+
+	namespace ast
+	{
+		// global empty value, for empty references
+		const value empty_value;
+
+		// compilation state
+		struct compiler
+		{
+			compiler(symbol_table &symbols, std::vector<tiny_template::path> &slots, std::set<std::string> &dependencies)
+				: symbols(symbols), slots(slots), dependencies(dependencies) {}
+
+			// context path read by a reference, with iterators replaced by their collection items
+			std::string context_path(const std::vector<std::string> &identifiers) const
+			{
+				std::string path = identifiers[0];
+				for (std::size_t i = iterators.size(); i-- > 0; )
+				{
+					if (*iterators[i] == identifiers[0])
+					{
+						path = iterator_paths[i];
+						break;
+					}
+				}
+				for (std::size_t i = 1; i < identifiers.size(); ++i) path += "." + identifiers[i];
+				return path;
+			}
+
+			// interns the identifiers of a reference, and returns its slot, or npos
+			// if the reference is rooted at the iterator of an enclosing #join
+			std::size_t slot(const std::vector<std::string> &identifiers, tiny_template::path &path)
+			{
+				dependencies.insert(context_path(identifiers));
+				path.clear();
+				for (const std::string &identifier : identifiers) path.push_back(symbols.intern(identifier));
+				for (const std::string *iterator : iterators)
+				{
+					if (*iterator == identifiers[0]) return symbol_table::npos;
+				}
+				std::map<tiny_template::path, std::size_t>::iterator it = slot_ids.find(path);
+				if (it != slot_ids.end())
+				{
+					reads.push_back(it->second);
+					return it->second;
+				}
+				slot_ids[path] = slots.size();
+				slots.push_back(path);
+				reads.push_back(slots.size() - 1);
+				return slots.size() - 1;
+			}
+
+			// distinct slots read since a given size of reads
+			std::vector<std::size_t> inputs(std::size_t start) const
+			{
+				std::vector<std::size_t> ret(reads.begin() + start, reads.end());
+				std::sort(ret.begin(), ret.end());
+				ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+				return ret;
+			}
+
+			symbol_table &symbols;
+			std::vector<tiny_template::path> &slots;
+			std::set<std::string> &dependencies;
+			std::map<tiny_template::path, std::size_t> slot_ids;
+			std::vector<const std::string *> iterators;
+			std::vector<std::string> iterator_paths; // items of the iterated collections
+			std::vector<std::size_t> reads; // slots read by the references compiled so far
+		};
+
+		const value * scope::find(const std::string &key) const
+		{
+			for (const scope *frame = this; frame->parent; frame = frame->parent)
+			{
+				if (*frame->name == key) return frame->value;
+			}
+			map::const_iterator it = params->find(key);
+			return it == params->end() ? nullptr : &it->second;
+		}
+
+		// lazy values resolved during a render, kept until its end since the
+		// render holds references to them; the store can live in a scratch arena
+		struct lazy_store
+		{
+			lazy_store(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) : memo(resource), transient(resource) {}
+			const value & resolve(const provider &source)
+			{
+				if (!source.memoize())
+				{
+					transient.push_front(source.resolve());
+					return transient.front();
+				}
+				std::unordered_map<const provider *, value>::iterator it = memo.find(&source);
+				if (it == memo.end()) it = memo.emplace(&source, source.resolve()).first;
+				return it->second;
+			}
+			std::pmr::unordered_map<const provider *, value> memo;
+			std::pmr::forward_list<value> transient;
+		};
+
+		std::string node::evaluate(const map &params) const
+		{
+			lazy_store lazy;
+			return evaluate(scope(params, nullptr, nullptr, &lazy));
+		}
+
+		void node::evaluate_to(sink &out, const map &params) const
+		{
+			lazy_store lazy;
+			evaluate_to(out, scope(params, nullptr, nullptr, &lazy));
+		}
+
+		// incremental render state
+		struct memoizer
+		{
+			memoizer(render_memo &memo, const tiny_template &tmpl, const scope &root) : memo(memo), tmpl(tmpl), root(root) {}
+
+			// replays the memoized output of a subtree if its inputs are unchanged, or renders it
+			template <typename Render> void render(const node &subtree, const scope &params, sink &out, Render render)
+			{
+				std::uint64_t key = this->key(subtree, params);
+				render_memo::fragment &f = memo.fragments[&subtree]; // stable across rehashes
+				if (f.valid && f.key == key)
+				{
+					++memo.hit_count;
+					out.write(f.output);
+					return;
+				}
+				++memo.miss_count;
+				f.valid = false;
+				std::string output;
+				string_sink capture(output);
+				render(capture);
+				f.key = key;
+				f.output = std::move(output);
+				f.valid = true;
+				out.write(f.output);
+			}
+
+			std::uint64_t key(const node &subtree, const scope &params);
+			std::uint64_t hash(const std::vector<std::size_t> &inputs);
+			std::uint64_t slot_hash(std::size_t slot);
+			std::uint64_t hash_slot(std::size_t slot);
+			std::uint64_t hash_value(const value &val);
+			static std::uint64_t combine(std::uint64_t seed, std::uint64_t h) { return seed ^ (h + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2)); }
+
+			render_memo &memo;
+			const tiny_template &tmpl;
+			const scope &root;
+			std::unordered_map<const node *, std::uint64_t> keys; // of the current render
+		};
+
+#ifdef TTL_PROFILE
+		// render profiling state: the stack of nodes being rendered
+		struct profiler
+		{
+			typedef std::chrono::steady_clock clock;
+
+			profiler(render_profile &profile) : profile(profile), overhead(0) {}
+
+			void render(const node &n, sink &out, const scope &params)
+			{
+				frame f(*this, n, out);
+				n.evaluate_to(f.counted, params);
+			}
+
+			// a node being rendered, recorded when done (or failed)
+			struct frame
+			{
+				frame(profiler &p, const node &n, sink &out) : p(p), n(n), counted(out)
+				{
+					std::size_t before = profiling::allocations;
+					p.stack.push_back(&n);
+					p.nested.push_back(std::chrono::nanoseconds(0));
+					p.overhead += profiling::allocations - before;
+					allocations = profiling::allocations - p.overhead;
+					start = clock::now();
+				}
+				~frame()
+				{
+					std::chrono::nanoseconds inclusive = clock::now() - start, exclusive = inclusive - p.nested.back();
+					// the allocations of the profiler itself are left out
+					std::size_t before = profiling::allocations, allocated = before - p.overhead - allocations;
+					render_profile::entry &e = p.profile.nodes[&n];
+					if (!e.calls)
+					{
+						e.label = label(n);
+						e.offset = n.offset;
+						e.line = n.line;
+					}
+					++e.calls;
+					e.inclusive += inclusive;
+					e.exclusive += exclusive;
+					e.bytes += counted.bytes;
+					e.allocations += allocated;
+					p.profile.stacks[p.stack] += exclusive;
+					p.stack.pop_back();
+					p.nested.pop_back();
+					if (!p.nested.empty()) p.nested.back() += inclusive;
+					p.overhead += profiling::allocations - before;
+				}
+
+				struct counting_sink : sink
+				{
+					counting_sink(sink &out) : out(out), bytes(0) {}
+					virtual void write(const char *data, std::size_t size) { bytes += size; out.write(data, size); }
+					using sink::write;
+					sink &out;
+					std::size_t bytes;
+				};
+
+				profiler &p;
+				const node &n;
+				counting_sink counted;
+				std::size_t allocations;
+				clock::time_point start;
+			};
+
+			static std::string label(const node &n);
+
+			render_profile &profile;
+			std::vector<const node *> stack;
+			std::vector<std::chrono::nanoseconds> nested; // inclusive time of the children of each frame
+			std::size_t overhead; // allocations of the profiler
+		};
+#endif
+
+		// renders a child node, through the profiler if any
+		inline void render(const node &child, sink &out, const scope &params)
+		{
+#ifdef TTL_PROFILE
+			if (params.profile) return params.profile->render(child, out, params);
+#endif
+			child.evaluate_to(out, params);
+		}
+
+		struct reference;
+
+		// comparison operand, rendered without allocation: when one side is a number value and the
+		// other one is numeric, they compare as numbers, else as rendered text
+		struct comparand
+		{
+			std::string_view text;
+			double number = 0.0;
+			bool is_number = false; // integer or real value
+			bool parsed = false; // number is known, if numeric
+			bool numeric = false;
+
+			// literal text, parsed once
+			static comparand literal(std::string_view text)
+			{
+				comparand c;
+				c.text = text;
+				c.numeric = parse(text, c.number);
+				c.parsed = true;
+				return c;
+			}
+			static bool parse(std::string_view text, double &number)
+			{
+				if (text.empty()) return false;
+				std::from_chars_result res = std::from_chars(text.data(), text.data() + text.size(), number);
+				return res.ec == std::errc() && res.ptr == text.data() + text.size();
+			}
+			bool to_number(double &value) const
+			{
+				if (parsed)
+				{
+					value = number;
+					return numeric;
+				}
+				return parse(text, value);
+			}
+			// three-way comparison
+			static int compare(const comparand &left, const comparand &right)
+			{
+				double l, r;
+				if ((left.is_number || right.is_number) && left.to_number(l) && right.to_number(r)) return l < r ? -1 : l > r ? 1 : 0;
+				int c = left.text.compare(right.text);
+				return c < 0 ? -1 : c > 0 ? 1 : 0;
+			}
+		};
+
+		// bytecode
+		struct program
+		{
+			enum opcode : unsigned char
+			{
+				EMIT_TEXT,     // write b chars of text at offset a
+				EMIT_SOURCE,   // write b chars of the borrowed source at offset a
+				EMIT_REF,      // write the value of operand a
+				JUMP,          // jump to a
+				JUMP_IF_FALSE, // jump to a unless the flag is set
+				TEST,          // set the flag to the truth value of operand a
+				CMP_EQ,        // set the flag if operands a and b compare equal
+				CMP_NE,        // ... if they differ
+				CMP_LT,        // ... if a is less than b
+				CMP_GT,        // ... if a is greater than b
+				CMP_LE,        // ... if a is less than or equal to b
+				CMP_GE,        // ... if a is greater than or equal to b
+				LOOP_BEGIN,    // enter loop a, or jump to b if its collection is empty
+				LOOP_NEXT      // advance loop a and jump to b, or leave the loop
+			};
+			struct instruction
+			{
+				opcode op;
+				std::uint32_t a;
+				std::uint32_t b;
+			};
+			// a reference, or literal text when ref is null
+			struct operand
+			{
+				const reference *ref;
+				std::uint32_t offset;
+				std::uint32_t length;
+				bool borrowed; // offset in the source rather than in text
+				bool numeric; // literal text parsed as a number
+				double number;
+			};
+			struct loop
+			{
+				const std::string *iterator;
+				std::uint32_t collection;
+				std::uint32_t separator;
+			};
+			static const std::uint32_t npos = static_cast<std::uint32_t>(-1);
+
+			// output size estimation heuristics
+			static const std::size_t reference_size = 16;
+			static const std::size_t loop_iterations = 8;
+
+			struct frame
+			{
+				const value *current;
+				const value *end;
+				scope inner;
+			};
+			// resumable execution state
+			struct cursor
+			{
+				cursor(const program &prog, const scope &params) : params(params), pc(0), frames(params.scratch), flag(false)
+				{
+					frames.reserve(prog.max_depth); // frames must not move, since inner scopes point to each other
+				}
+				const scope &params;
+				std::size_t pc;
+				std::pmr::vector<frame> frames;
+				bool flag;
+			};
+
+			void run(sink &out, const scope &params) const;
+			// runs until the end, and returns true, or until pause() returns true
+			template <typename Pause> bool run(sink &out, cursor &pos, Pause pause) const;
+			// operand as a comparand; buffer needs reference::format_size chars
+			comparand compared(std::uint32_t index, const scope &params, char *buffer) const;
+
+			static const char * operator_string(opcode op)
+			{
+				switch (op)
+				{
+					case CMP_EQ: return "==";
+					case CMP_NE: return "!=";
+					case CMP_LT: return "<";
+					case CMP_GT: return ">";
+					case CMP_LE: return "<=";
+					case CMP_GE: return ">=";
+					default: return "";
+				}
+			}
+			// comparison opcode of an operator, if any
+			static bool comparison(std::string_view symbol, opcode &op)
+			{
+				for (opcode cmp : { CMP_EQ, CMP_NE, CMP_LT, CMP_GT, CMP_LE, CMP_GE })
+				{
+					if (symbol == operator_string(cmp))
+					{
+						op = cmp;
+						return true;
+					}
+				}
+				return false;
+			}
+			// whether a three-way comparison result satisfies a comparison opcode
+			static bool satisfies(opcode op, int cmp)
+			{
+				switch (op)
+				{
+					case CMP_EQ: return cmp == 0;
+					case CMP_NE: return cmp != 0;
+					case CMP_LT: return cmp < 0;
+					case CMP_GT: return cmp > 0;
+					case CMP_LE: return cmp <= 0;
+					case CMP_GE: return cmp >= 0;
+					default: return false;
+				}
+			}
+
+			const char * literal(const operand &op) const { return (op.borrowed ? source.data() : text.data()) + op.offset; }
+
+			std::vector<instruction> code;
+			std::string text;
+			std::string_view source; // template source, if literal text can be borrowed from it
+			std::vector<operand> operands;
+			std::vector<loop> loops;
+			std::size_t max_depth = 0;
+			std::size_t estimated_size = 0;
+		};
+
+		// tree simplification state
+		struct optimizer
+		{
+			optimizer() : removed(0) {}
+			void simplify(node_ptr &n)
+			{
+				node_ptr replacement = n->simplify(*this);
+				if (replacement) n = replacement;
+			}
+			node_ptr concat(std::string_view first, std::string_view second, bool borrowed);
+			// nodes of a subtree
+			static std::size_t count(const node &n);
+			// whether a condition only depends on literals, and its value
+			static bool constant(const node &cond, bool &value);
+			static bool empty(const node &n);
+			std::size_t removed;
+		};
+
+		// bytecode generation state
+		struct assembler
+		{
+			assembler(program &prog) : prog(prog), depth(0), weight(1), mergeable(false) {}
+			std::uint32_t emit(program::opcode op, std::uint32_t a = 0, std::uint32_t b = 0)
+			{
+				prog.code.push_back({ op, a, b });
+				mergeable = false;
+				return static_cast<std::uint32_t>(prog.code.size() - 1);
+			}
+			// current position, as a jump target
+			std::uint32_t label()
+			{
+				mergeable = false;
+				return static_cast<std::uint32_t>(prog.code.size());
+			}
+			// literal text, merged with the previous instruction when possible
+			void text(std::string_view str)
+			{
+				if (str.empty()) return;
+				prog.estimated_size += str.size() * weight;
+				bool borrowed = borrowable(str);
+				program::opcode op = borrowed ? program::EMIT_SOURCE : program::EMIT_TEXT;
+				std::uint32_t offset = static_cast<std::uint32_t>(borrowed ? str.data() - prog.source.data() : prog.text.size());
+				if (mergeable && prog.code.back().op == op && prog.code.back().a + prog.code.back().b == offset) prog.code.back().b += str.size();
+				else
+				{
+					emit(op, offset, str.size());
+					mergeable = true;
+				}
+				if (!borrowed) prog.text += str;
+			}
+			// whether literal text is a slice of the source
+			bool borrowable(std::string_view str) const
+			{
+				return !prog.source.empty() && str.data() >= prog.source.data() && str.data() + str.size() <= prog.source.data() + prog.source.size();
+			}
+			std::uint32_t operand(const node &value);
+			void condition(const node &cond);
+			program &prog;
+			std::size_t depth;
+			std::size_t weight; // estimated number of times the current code runs
+			bool mergeable;
+		};
+
+		struct parent_node : node
+		{
+			parent_node(std::vector<node_ptr> &&children) : children(std::move(children)) {}
+#ifndef TTL_NO_SPIRIT
+			template <typename T> parent_node(std::vector<T> &v)
+			{
+				for (T &t : v)
+				{
+					children.push_back(boost::get<node_ptr>(t));
+				}
+			}
+#endif
+			virtual ~parent_node() {}
+			virtual void evaluate_to(sink &out, const scope &params) const
+			{
+				if (params.memo) params.memo->render(*this, params, out, [&](sink &capture) { render_to(capture, params); });
+				else render_to(out, params);
+			}
+			void render_to(sink &out, const scope &params) const
+			{
+				for (const node_ptr &node : children) render(*node, out, params);
+			}
+			virtual std::string debug() const
+			{
+				std::string ret;
+				for (const node_ptr &node : children) ret += node->debug();
+				return ret;
+			}
+            virtual bool test(const scope &) const { throw evaluation_error("parent_node cannot be tested"); }
+			virtual void compile(compiler &c)
+			{
+				for (node_ptr &node : children) node->compile(c);
+			}
+			virtual void assemble(assembler &a) const
+			{
+				for (const node_ptr &node : children) node->assemble(a);
+			}
+			virtual node_ptr simplify(optimizer &o);
+			std::vector<node_ptr> children;
+		};
+
+		struct text : node
+		{
+			text(const std::string &s) : storage(s), value(storage) {}
+			// borrowed text, which must outlive the node
+			text(std::string_view s) : value(s) {}
+			virtual ~text() {}
+			virtual void evaluate_to(sink &out, const scope &params) const { out.write(value.data(), value.size()); }
+			virtual std::string debug() const { return std::string(value); }
+            virtual bool test(const scope &) const { return !value.empty(); }
+			virtual void compile(compiler &) {}
+			virtual void assemble(assembler &a) const { a.text(value); }
+			bool borrowed() const { return value.data() != storage.data(); }
+			std::string storage;
+			std::string_view value;
+		};
+		
+		node_ptr parent_node::simplify(optimizer &o)
+		{
+			// splice nested sequences
+			std::vector<node_ptr> flat;
+			for (node_ptr &node : children)
+			{
+				o.simplify(node);
+				const parent_node *nested = node->get<parent_node>();
+				if (!nested) flat.push_back(node);
+				else
+				{
+					flat.insert(flat.end(), nested->children.begin(), nested->children.end());
+					++o.removed;
+				}
+			}
+			// merge adjacent text, and drop empty text
+			children.clear();
+			for (node_ptr &node : flat)
+			{
+				const ast::text *literal = node->get<ast::text>();
+				const ast::text *previous = children.empty() ? nullptr : children.back()->get<ast::text>();
+				if (literal && (literal->value.empty() || previous))
+				{
+					if (previous) children.back() = o.concat(previous->value, literal->value, previous->borrowed() && literal->borrowed());
+					++o.removed;
+				}
+				else children.push_back(node);
+			}
+			if (children.size() != 1) return node_ptr();
+			++o.removed;
+			return children[0];
+		}
+
+		struct reference : node
+		{
+			reference(const std::vector<std::string> &vect, escape_mode escape = escape_mode::none)
+				: identifiers(vect), slot(symbol_table::npos), escape(escape) {}
+			virtual ~reference() {}
+
+			virtual void evaluate_to(sink &out, const scope &params) const { write(out, resolve(params), escape); }
+
+			static void write(sink &out, const value &prop, escape_mode mode = escape_mode::none)
+			{
+				char buffer[format_size];
+				std::string_view str = format(prop, buffer);
+				if (mode == escape_mode::none) out.write(str.data(), str.size());
+				else ttl::escape(out, str, mode);
+			}
+
+			// comparison operand, formatting numbers into the buffer
+			static comparand compared(const value &prop, char *buffer)
+			{
+				comparand c;
+				c.text = format(prop, buffer);
+				if (prop.type() == value::kind::integer || prop.type() == value::kind::real)
+				{
+					c.number = prop.as_real();
+					c.is_number = c.parsed = c.numeric = true;
+				}
+				return c;
+			}
+
+			// renders a scalar value, formatting numbers into the buffer
+			static constexpr std::size_t format_size = 32;
+			static std::string_view format(const value &prop, char *buffer)
+			{
+				switch (prop.type())
+				{
+					case value::kind::null: return std::string_view();
+					case value::kind::string:
+					case value::kind::string_view: return prop.as_string();
+					case value::kind::integer: return std::string_view(buffer, std::to_chars(buffer, buffer + format_size, prop.as_integer()).ptr - buffer);
+					case value::kind::real: return std::string_view(buffer, std::to_chars(buffer, buffer + format_size, prop.as_real()).ptr - buffer);
+					case value::kind::boolean: return prop.as_boolean() ? "true" : "false";
+					default: throw evaluation_error("wrong type");
+				}
+			}
+
+			const value & resolve(const scope &params) const
+			{
+				if (params.index && slot != symbol_table::npos)
+				{
+					const value *prop = params.index->slot(slot);
+					if (prop) return materialize(*prop, params);
+					// unresolved slots take the regular path, to report errors
+				}
+				return walk(params.find(identifiers[0]), identifiers.data(), identifiers.size(), params);
+			}
+
+			// follows a path from the value of its first identifier (nullptr if missing)
+			static const value & walk(const value *prop, const std::string *identifiers, std::size_t size, const scope &params)
+			{
+				for (std::size_t i = 0; ; ++i)
+				{
+					if (!prop)
+					{
+						if (i == size - 1) return empty_value; // empty string for empty references
+						throw evaluation_error("parameter '" + identifiers[i] + "' not found");
+					}
+					prop = &materialize(*prop, params);
+					if (i == size - 1) break;
+					if (!prop->is_map()) throw evaluation_error("parameter '" + identifiers[i] + "' is not a map");
+					prop = prop->find(identifiers[i + 1]);
+				}
+				return *prop;
+			}
+			
+			virtual std::string debug() const { return "{" + debug_inner() + filter_name(escape) + "}"; }
+			static const char * filter_name(escape_mode mode)
+			{
+				switch (mode)
+				{
+					case escape_mode::html: return "|html";
+					case escape_mode::json: return "|json";
+					case escape_mode::url: return "|url";
+					default: return "";
+				}
+			}
+			std::string debug_inner() const { return "$" + boost::join(identifiers, "."); }
+
+			// lazy values get resolved through the render store
+			static const value & materialize(const value &prop, const scope &params)
+			{
+				if (!prop.is_lazy()) return prop;
+				if (!params.lazy) throw evaluation_error("lazy value outside of a render");
+				const value *resolved = &prop;
+				while (resolved->is_lazy()) resolved = &params.lazy->resolve(resolved->as_provider());
+				return *resolved;
+			}
+
+			virtual bool test(const scope &params) const
+			{
+				const value *prop;
+				try { prop = &resolve(params); } catch (std::exception &) { return false; }
+				return prop->test(); /* empty strings and containers are false */
+			}
+			virtual void compile(compiler &c) { slot = c.slot(identifiers, symbols); }
+			virtual void assemble(assembler &a) const
+			{
+				a.emit(program::EMIT_REF, a.operand(*this));
+				a.prog.estimated_size += program::reference_size * a.weight;
+			}
+			std::vector<std::string> identifiers;
+			tiny_template::path symbols;
+			std::size_t slot;
+			escape_mode escape;
+		};
+
+        struct condition : node
+        {
+			condition() {}
+            virtual ~condition() {}
+            virtual void evaluate_to(sink &, const scope &) const { throw evaluation_error("condition cannot be evaluated"); }
+            virtual void assemble(assembler &) const { throw evaluation_error("condition cannot be evaluated"); }
+            virtual std::string operator_string() const = 0;
+        };
+    
+        struct binary_operator : condition
+        {
+			binary_operator(node_ptr left_, node_ptr right_)
+			{
+                left = left_;
+                right = right_;
+                // operand kinds are resolved once, and literal operands parsed once
+                left_ref = left->get<reference>();
+                right_ref = right->get<reference>();
+                if (const ast::text *literal = left->get<ast::text>()) left_literal = comparand::literal(literal->value);
+                if (const ast::text *literal = right->get<ast::text>()) right_literal = comparand::literal(literal->value);
+            }
+            virtual ~binary_operator() {}
+            virtual std::string debug() const
+            {
+                return ( left_ref ? left_ref->debug_inner() : left->debug() ) + " " +
+                        operator_string() + " " +
+                        ( right_ref ? right_ref->debug_inner() : right->debug() );
+            }
+			virtual bool test(const scope &params) const
+            {
+                char left_buffer[reference::format_size], right_buffer[reference::format_size];
+                return apply_operator(left_ref ? reference::compared(left_ref->resolve(params), left_buffer) : left_literal,
+                                      right_ref ? reference::compared(right_ref->resolve(params), right_buffer) : right_literal);
+            }
+            virtual bool apply_operator(const comparand &left_value, const comparand &right_value) const
+            {
+                return program::satisfies(opcode(), comparand::compare(left_value, right_value));
+            }
+            virtual program::opcode opcode() const = 0;
+            virtual void compile(compiler &c)
+            {
+                left->compile(c);
+                right->compile(c);
+            }
+            node_ptr left;
+            node_ptr right;
+            const reference *left_ref, *right_ref; // null unless the operand is a reference
+            comparand left_literal, right_literal;
+        };
+
+        // ==, !=, <, >, <= and >=
+        struct comparison_operator : binary_operator
+        {
+            comparison_operator(program::opcode op, node_ptr left, node_ptr right) : binary_operator(left, right), op(op)
+            {
+            }
+
+            virtual std::string operator_string() const { return program::operator_string(op); }
+            virtual program::opcode opcode() const { return op; }
+            program::opcode op;
+        };
+    
+		struct if_directive : node
+		{
+			if_directive(std::vector<node_ptr> &&conditions, std::vector<node_ptr> &&parts)
+				: condition_nodes(std::move(conditions)), part_nodes(std::move(parts)) {}
+#ifndef TTL_NO_SPIRIT
+			template <typename tuple> if_directive(tuple & t)
+			{
+				using boost::fusion::at_c;
+				condition_nodes.push_back(at_c<0>(t));
+				part_nodes.push_back(at_c<1>(t));
+				for (auto &elseif : at_c<2>(t))
+				{
+					condition_nodes.push_back(at_c<0>(elseif));
+					part_nodes.push_back(at_c<1>(elseif));
+				}
+                
+				if (at_c<3>(t)) part_nodes.push_back(*at_c<3>(t));
+			}
+#endif
+			virtual ~if_directive() {}
+			virtual void evaluate_to(sink &out, const scope &params) const
+			{
+				if (params.memo) params.memo->render(*this, params, out, [&](sink &capture) { render_to(capture, params); });
+				else render_to(out, params);
+			}
+			void render_to(sink &out, const scope &params) const
+			{
+				if (!condition_nodes.size() || part_nodes.size() < condition_nodes.size() || part_nodes.size() > condition_nodes.size() + 1) throw evaluation_error("malformed #if directive");
+                int cond = 0;
+                for (; cond < condition_nodes.size(); ++cond)
+                {
+                    if (condition_nodes[cond]->test(params)) return render(*part_nodes[cond], out, params);
+                }
+                if (part_nodes.size() > cond) render(*part_nodes[cond], out, params);
+			}
+			virtual std::string debug() const
+			{
+                std::string dbg;
+                int cond = 0;
+                for (; cond < condition_nodes.size(); ++cond)
+                {
+                    if (cond == 0) dbg = "{#if "; else dbg += "{#elseif ";
+                    const reference* ref = condition_nodes[cond]->get<reference>();
+					std::string cond_string;
+                    if (ref) cond_string = ref->debug_inner();
+                    else cond_string = condition_nodes[cond]->debug();
+                    dbg += cond_string + "}" + part_nodes[cond]->debug();
+                }
+                if (part_nodes.size() > cond) dbg += "{#else}" + part_nodes[cond]->debug();
+                dbg += "{#end}";
+                return dbg;
+			}
+            virtual bool test(const scope &) const { throw evaluation_error("#if directive cannot be tested"); }
+            virtual void compile(compiler &c)
+            {
+                condition_inputs.clear();
+                for (node_ptr &node : condition_nodes)
+                {
+                    std::size_t start = c.reads.size();
+                    node->compile(c);
+                    condition_inputs.push_back(c.inputs(start));
+                }
+                for (node_ptr &node : part_nodes) node->compile(c);
+            }
+            virtual void assemble(assembler &a) const
+            {
+                std::vector<std::uint32_t> exits;
+                std::size_t cond = 0;
+                for (; cond < condition_nodes.size(); ++cond)
+                {
+                    a.condition(*condition_nodes[cond]);
+                    std::uint32_t skip = a.emit(program::JUMP_IF_FALSE);
+                    part_nodes[cond]->assemble(a);
+                    if (cond + 1 < part_nodes.size()) exits.push_back(a.emit(program::JUMP));
+                    a.prog.code[skip].a = a.label();
+                }
+                if (part_nodes.size() > cond) part_nodes[cond]->assemble(a);
+                std::uint32_t end = a.label();
+                for (std::uint32_t exit : exits) a.prog.code[exit].a = end;
+            }
+            virtual node_ptr simplify(optimizer &o)
+            {
+                for (node_ptr &node : condition_nodes) o.simplify(node);
+                for (node_ptr &node : part_nodes) o.simplify(node);
+                std::vector<node_ptr> conditions, parts;
+                std::size_t cond = 0;
+                bool decided = false;
+                for (; cond < condition_nodes.size() && !decided; ++cond)
+                {
+                    bool value;
+                    if (!optimizer::constant(*condition_nodes[cond], value))
+                    {
+                        conditions.push_back(condition_nodes[cond]);
+                        parts.push_back(part_nodes[cond]);
+                        continue;
+                    }
+                    o.removed += optimizer::count(*condition_nodes[cond]);
+                    // a true condition turns its part into the #else part, and the next ones are dead
+                    if (value) parts.push_back(part_nodes[cond]);
+                    else o.removed += optimizer::count(*part_nodes[cond]);
+                    decided = value;
+                }
+                for (std::size_t dead = cond; dead < condition_nodes.size(); ++dead) o.removed += optimizer::count(*condition_nodes[dead]);
+                for (std::size_t dead = decided ? cond : part_nodes.size(); dead < part_nodes.size(); ++dead) o.removed += optimizer::count(*part_nodes[dead]);
+                if (!decided && part_nodes.size() > condition_nodes.size()) parts.push_back(part_nodes.back());
+                if (parts.size() > conditions.size() && optimizer::empty(*parts.back()))
+                {
+                    o.removed += optimizer::count(*parts.back());
+                    parts.pop_back();
+                }
+                if (conditions.empty())
+                {
+                    // replaced by its #else part, or by empty text
+                    if (parts.empty()) return node_ptr(new ast::text(std::string()));
+                    ++o.removed;
+                    return parts[0];
+                }
+                condition_nodes = std::move(conditions);
+                part_nodes = std::move(parts);
+                return node_ptr();
+            }
+			std::vector<node_ptr> condition_nodes;
+            std::vector<node_ptr> part_nodes;
+            std::vector<std::vector<std::size_t>> condition_inputs; // slots read by each condition
+		};
+		
+		struct join_directive : node
+		{
+			join_directive(node_ptr iterator_, node_ptr collection_, node_ptr separator_, node_ptr content_)
+				: iterator(iterator_), collection(collection_), separator(separator_), content(content_)
+			{
+				if (!iterator->get<reference>() || iterator->get<reference>()->identifiers.size() != 1)
+					throw parsing_error("malformed #join directive");
+			}
+#ifndef TTL_NO_SPIRIT
+			template <typename tuple> join_directive(tuple & t)
+				: join_directive(boost::fusion::at_c<0>(t), boost::fusion::at_c<1>(t),
+								 boost::fusion::at_c<2>(t) ? *boost::fusion::at_c<2>(t) : node_ptr(), boost::fusion::at_c<3>(t)) {}
+#endif
+			virtual ~join_directive() {}
+			virtual void evaluate_to(sink &out, const scope &params) const
+			{
+				if (params.memo) params.memo->render(*this, params, out, [&](sink &capture) { render_to(capture, params); });
+				else render_to(out, params);
+			}
+			void render_to(sink &out, const scope &params) const
+			{
+				const std::string &itname = iterator->get<reference>()->identifiers[0];
+				const value & values = collection->get<reference>()->resolve(params);
+				// a non-vector value is iterated as a single item
+				const value *begin = &values, *end = &values + 1;
+				if (values.is_vector())
+				{
+					begin = values.as_vector().data();
+					end = begin + values.as_vector().size();
+				}
+				if (params.parallel && params.parallel->pool && static_cast<std::size_t>(end - begin) >= params.parallel->threshold)
+					return render_parallel(out, params, itname, begin, end);
+				for (const value *item = begin; item != end; ++item)
+				{
+					if (item != begin && separator) render(*separator, out, params);
+					render(*content, out, scope(params, itname, *item));
+				}
+			}
+
+			// renders chunks of the collection into their own buffers on the pool, and splices them
+			void render_parallel(sink &out, const scope &params, const std::string &itname, const value *begin, const value *end) const
+			{
+				thread_pool &pool = *params.parallel->pool;
+				std::string sep;
+				if (separator)
+				{
+					string_sink sep_out(sep);
+					separator->evaluate_to(sep_out, params);
+				}
+				std::size_t count = end - begin, chunks = std::min<std::size_t>(count, (pool.size() + 1) * 4);
+				std::vector<std::string> outputs(chunks);
+				pool.parallel_for(chunks, [&](std::size_t chunk)
+				{
+					// the lazy values store and the scratch arena are not thread-safe
+					lazy_store lazy;
+					scope local(params);
+					local.lazy = &lazy;
+					local.scratch = std::pmr::get_default_resource();
+					local.memo = nullptr;
+					local.profile = nullptr;
+					string_sink chunk_out(outputs[chunk]);
+					const value *first = begin + count * chunk / chunks, *last = begin + count * (chunk + 1) / chunks;
+					for (const value *item = first; item != last; ++item)
+					{
+						if (item != first) chunk_out.write(sep);
+						content->evaluate_to(chunk_out, scope(local, itname, *item));
+					}
+				});
+				for (std::size_t chunk = 0; chunk < chunks; ++chunk)
+				{
+					if (chunk) out.write(sep);
+					out.write(outputs[chunk]);
+				}
+			}
+
+            virtual bool test(const scope &) const { throw evaluation_error("#join directive cannot be tested"); }
+
+			virtual void compile(compiler &c)
+			{
+				const std::string &itname = iterator->get<reference>()->identifiers[0];
+				c.symbols.intern(itname);
+				std::size_t start = c.reads.size();
+				collection->compile(c);
+				if (separator) separator->compile(c);
+				c.iterators.push_back(&itname);
+				c.iterator_paths.push_back(c.context_path(collection->get<reference>()->identifiers) + "[]");
+				content->compile(c);
+				c.iterators.pop_back();
+				c.iterator_paths.pop_back();
+				inputs = c.inputs(start);
+			}
+
+			virtual void assemble(assembler &a) const
+			{
+				program::loop loop = { &iterator->get<reference>()->identifiers[0], a.operand(*collection), program::npos };
+				if (separator) loop.separator = a.operand(*separator);
+				std::uint32_t index = static_cast<std::uint32_t>(a.prog.loops.size());
+				a.prog.loops.push_back(loop);
+				std::uint32_t begin = a.emit(program::LOOP_BEGIN, index);
+				std::uint32_t body = a.label();
+				if (++a.depth > a.prog.max_depth) a.prog.max_depth = a.depth;
+				a.weight *= program::loop_iterations;
+				const ast::text *literal = separator ? separator->get<ast::text>() : nullptr;
+				a.prog.estimated_size += (literal ? literal->value.size() : separator ? program::reference_size : 0) * a.weight;
+				content->assemble(a);
+				a.weight /= program::loop_iterations;
+				--a.depth;
+				a.emit(program::LOOP_NEXT, index, body);
+				a.prog.code[begin].b = a.label();
+			}
+            
+			virtual std::string debug() const
+			{
+				return "{#join $" + iterator->get<reference>()->identifiers[0] + " in $" + boost::join(collection->get<reference>()->identifiers, ".") +
+					( separator ? " with '" + separator->debug() + "'" : std::string() ) + "}" + content->debug() + "{#end}";
+			}
+			virtual node_ptr simplify(optimizer &o)
+			{
+				// the separator is left as is: it is a single literal or reference, which has nothing
+				// to simplify, and must remain one to be a loop operand of the bytecode
+				o.simplify(content);
+				return node_ptr();
+			}
+			
+			node_ptr iterator;	
+			node_ptr collection;
+			node_ptr separator;
+			node_ptr content;
+			std::vector<std::size_t> inputs; // slots read by the subtree
+		};
+
+		node_ptr optimizer::concat(std::string_view first, std::string_view second, bool borrowed)
+		{
+			// contiguous borrowed slices stay borrowed
+			if (borrowed && first.data() + first.size() == second.data()) return node_ptr(new ast::text(std::string_view(first.data(), first.size() + second.size())));
+			std::string value;
+			value.reserve(first.size() + second.size());
+			value.append(first).append(second);
+			return node_ptr(new ast::text(value));
+		}
+
+#ifdef TTL_PROFILE
+		std::string profiler::label(const node &n)
+		{
+			std::string ret;
+			if (n.get<parent_node>()) ret = "sequence";
+			else if (n.get<text>()) ret = "text";
+			else if (const if_directive *directive = n.get<if_directive>())
+			{
+				ret = "#if";
+				if (!directive->condition_nodes.empty())
+				{
+					const node &cond = *directive->condition_nodes[0];
+					ret += " " + (cond.get<reference>() ? cond.get<reference>()->debug_inner() : cond.debug());
+				}
+			}
+			else if (const join_directive *directive = n.get<join_directive>())
+				ret = "#join " + directive->iterator->get<reference>()->debug_inner() + " in " + directive->collection->get<reference>()->debug_inner();
+			else ret = n.debug();
+			// ';' separates the frames of folded stacks
+			std::replace_if(ret.begin(), ret.end(), [](char c) { return c == ';' || c == '\n' || c == '\r'; }, ' ');
+			return ret;
+		}
+#endif
+
+		std::size_t optimizer::count(const node &n)
+		{
+			std::size_t ret = 1;
+			if (const parent_node *parent = n.get<parent_node>())
+			{
+				for (const node_ptr &child : parent->children) ret += count(*child);
+			}
+			else if (const if_directive *directive = n.get<if_directive>())
+			{
+				for (const node_ptr &child : directive->condition_nodes) ret += count(*child);
+				for (const node_ptr &child : directive->part_nodes) ret += count(*child);
+			}
+			else if (const join_directive *directive = n.get<join_directive>())
+			{
+				ret += count(*directive->iterator) + count(*directive->collection) + count(*directive->content);
+				if (directive->separator) ret += count(*directive->separator);
+			}
+			else if (const binary_operator *op = n.get<binary_operator>()) ret += count(*op->left) + count(*op->right);
+			return ret;
+		}
+
+		bool optimizer::constant(const node &cond, bool &value)
+		{
+			if (const ast::text *literal = cond.get<ast::text>())
+			{
+				value = !literal->value.empty();
+				return true;
+			}
+			const binary_operator *op = cond.get<binary_operator>();
+			if (!op || !op->left->get<ast::text>() || !op->right->get<ast::text>()) return false;
+			value = op->apply_operator(op->left_literal, op->right_literal);
+			return true;
+		}
+
+		bool optimizer::empty(const node &n)
+		{
+			const ast::text *literal = n.get<ast::text>();
+			const parent_node *parent = n.get<parent_node>();
+			return (literal && literal->value.empty()) || (parent && parent->children.empty());
+		}
+
+		std::size_t node::optimize(node_ptr &root)
+		{
+			optimizer o;
+			o.simplify(root);
+			return o.removed;
+		}
+		
+		std::uint32_t assembler::operand(const node &value)
+		{
+			program::operand op = { value.get<reference>(), 0, 0, false, false, 0.0 };
+			if (!op.ref)
+			{
+				const ast::text *literal = value.get<ast::text>();
+				if (!literal) throw parsing_error("invalid operand");
+				op.length = static_cast<std::uint32_t>(literal->value.size());
+				op.numeric = comparand::parse(literal->value, op.number);
+				op.borrowed = borrowable(literal->value);
+				if (op.borrowed) op.offset = static_cast<std::uint32_t>(literal->value.data() - prog.source.data());
+				else
+				{
+					op.offset = static_cast<std::uint32_t>(prog.text.size());
+					prog.text += literal->value;
+				}
+			}
+			prog.operands.push_back(op);
+			return static_cast<std::uint32_t>(prog.operands.size() - 1);
+		}
+
+		void assembler::condition(const node &cond)
+		{
+			const binary_operator *op = cond.get<binary_operator>();
+			if (op) emit(op->opcode(), operand(*op->left), operand(*op->right));
+			else emit(program::TEST, operand(cond));
+		}
+
+		// hash of the inputs read by a render of the subtree: like the render, #if directives only
+		// read the conditions up to the first true one, and the part it selects, so that lazy
+		// values of the other branches are not resolved
+		std::uint64_t memoizer::key(const node &subtree, const scope &params)
+		{
+			std::unordered_map<const node *, std::uint64_t>::iterator it = keys.find(&subtree);
+			if (it != keys.end()) return it->second;
+			std::uint64_t h = 0;
+			if (const parent_node *parent = subtree.get<parent_node>())
+			{
+				h = parent->children.size();
+				for (const node_ptr &child : parent->children) h = combine(h, key(*child, params));
+			}
+			else if (const if_directive *directive = subtree.get<if_directive>())
+			{
+				std::size_t cond = 0;
+				for (; cond < directive->condition_nodes.size(); ++cond)
+				{
+					h = combine(h, hash(directive->condition_inputs[cond]));
+					if (directive->condition_nodes[cond]->test(params)) break;
+				}
+				h = combine(h, cond);
+				if (cond < directive->part_nodes.size()) h = combine(h, key(*directive->part_nodes[cond], params));
+			}
+			else if (const join_directive *join = subtree.get<join_directive>()) h = hash(join->inputs);
+			else if (const reference *ref = subtree.get<reference>()) h = ref->slot == symbol_table::npos ? 0 : slot_hash(ref->slot);
+			keys.emplace(&subtree, h);
+			return h;
+		}
+
+		std::uint64_t memoizer::hash(const std::vector<std::size_t> &inputs)
+		{
+			std::uint64_t h = inputs.size();
+			for (std::size_t slot : inputs) h = combine(h, slot_hash(slot));
+			return h;
+		}
+
+		// hash of a slot, computed once per render
+		std::uint64_t memoizer::slot_hash(std::size_t slot)
+		{
+			if (!memo.hashed[slot])
+			{
+				memo.slot_hashes[slot] = hash_slot(slot);
+				memo.hashed[slot] = true;
+			}
+			return memo.slot_hashes[slot];
+		}
+
+		std::uint64_t memoizer::hash_slot(std::size_t slot)
+		{
+			// same resolution as reference::resolve; values missing at different depths
+			// hash differently, since they render differently
+			const std::uint64_t missing = 0x6d697373696e67ull;
+			std::size_t depth = 0;
+			try
+			{
+				const value *prop = nullptr;
+				const map *m = root.params;
+				for (std::size_t id : tmpl.slots()[slot])
+				{
+					if (!m) return combine(missing, depth);
+					map::const_iterator it = m->find(tmpl.symbols().name(id));
+					if (it == m->end()) return combine(missing, depth);
+					++depth;
+					prop = &reference::materialize(it->second, root);
+					m = prop->is_map() ? &prop->as_map() : nullptr;
+				}
+				return hash_value(*prop);
+			}
+			catch (std::exception &)
+			{
+				return combine(missing, depth);
+			}
+		}
+
+		std::uint64_t memoizer::hash_value(const value &val)
+		{
+			const value &prop = reference::materialize(val, root);
+			std::uint64_t h = static_cast<std::uint64_t>(prop.type());
+			switch (prop.type())
+			{
+				case value::kind::string:
+				case value::kind::string_view: return combine(h, std::hash<std::string_view>()(prop.as_string()));
+				case value::kind::integer: return combine(h, static_cast<std::uint64_t>(prop.as_integer()));
+				case value::kind::real: return combine(h, std::hash<double>()(prop.as_real()));
+				case value::kind::boolean: return combine(h, prop.as_boolean());
+				case value::kind::vector:
+					h = combine(h, prop.as_vector().size());
+					for (const value &item : prop.as_vector()) h = combine(h, hash_value(item));
+					return h;
+				case value::kind::map:
+					h = combine(h, prop.as_map().size());
+					for (const auto &pair : prop.as_map()) h = combine(combine(h, std::hash<std::string>()(pair.first)), hash_value(pair.second));
+					return h;
+				default: return h;
+			}
+		}
+
+		comparand program::compared(std::uint32_t index, const scope &params, char *buffer) const
+		{
+			const operand &op = operands[index];
+			if (op.ref) return reference::compared(op.ref->resolve(params), buffer);
+			comparand c;
+			c.text = std::string_view(literal(op), op.length);
+			c.number = op.number;
+			c.numeric = op.numeric;
+			c.parsed = true;
+			return c;
+		}
+
+		void program::run(sink &out, const scope &params) const
+		{
+			cursor pos(*this, params);
+			run(out, pos, []() { return false; });
+		}
+
+		template <typename Pause> bool program::run(sink &out, cursor &pos, Pause pause) const
+		{
+			const scope &params = pos.params;
+			std::pmr::vector<frame> &frames = pos.frames;
+			char left_buffer[reference::format_size], right_buffer[reference::format_size];
+			bool flag = pos.flag;
+			const instruction *begin = code.data(), *end = begin + code.size(), *pc = begin + pos.pc;
+			while (pc != end)
+			{
+				if (pause())
+				{
+					pos.pc = pc - begin;
+					pos.flag = flag;
+					return false;
+				}
+				const instruction &ins = *pc++;
+				const scope &current = frames.empty() ? params : frames.back().inner;
+				switch (ins.op)
+				{
+					case EMIT_TEXT:
+						out.write(text.data() + ins.a, ins.b);
+						break;
+					case EMIT_SOURCE:
+						out.write(source.data() + ins.a, ins.b);
+						break;
+					case EMIT_REF:
+					{
+						const reference &ref = *operands[ins.a].ref;
+						reference::write(out, ref.resolve(current), ref.escape);
+						break;
+					}
+					case JUMP:
+						pc = begin + ins.a;
+						break;
+					case JUMP_IF_FALSE:
+						if (!flag) pc = begin + ins.a;
+						break;
+					case TEST:
+					{
+						const operand &op = operands[ins.a];
+						if (!op.ref) flag = op.length != 0;
+						else
+						{
+							try { flag = op.ref->resolve(current).test(); } catch (std::exception &) { flag = false; }
+						}
+						break;
+					}
+					case CMP_EQ:
+					case CMP_NE:
+					case CMP_LT:
+					case CMP_GT:
+					case CMP_LE:
+					case CMP_GE:
+						flag = satisfies(ins.op, comparand::compare(compared(ins.a, current, left_buffer), compared(ins.b, current, right_buffer)));
+						break;
+					case LOOP_BEGIN:
+					{
+						const loop &l = loops[ins.a];
+						const value &values = operands[l.collection].ref->resolve(current);
+						// a non-vector value is iterated as a single item
+						const value *first = &values, *last = &values + 1;
+						if (values.is_vector())
+						{
+							first = values.as_vector().data();
+							last = first + values.as_vector().size();
+						}
+						if (first == last) pc = begin + ins.b;
+						else frames.push_back({ first, last, scope(current, *l.iterator, *first) });
+						break;
+					}
+					case LOOP_NEXT:
+					{
+						frame &f = frames.back();
+						if (++f.current == f.end)
+						{
+							frames.pop_back();
+							break;
+						}
+						const loop &l = loops[ins.a];
+						if (l.separator != npos)
+						{
+							const operand &sep = operands[l.separator];
+							if (sep.ref) reference::write(out, sep.ref->resolve(*f.inner.parent), sep.ref->escape);
+							else out.write(literal(sep), sep.length);
+						}
+						f.inner.value = f.current;
+						pc = begin + ins.b;
+						break;
+					}
+				}
+			}
+			pos.pc = code.size();
+			return true;
+		}
+
+	} // namespace ast
+
+	// Grammar
+
+#ifndef TTL_NO_SPIRIT
+	
+#define DECLARE_RULE(name, value)							 \
+	struct name ## _id;													 \
+	rule<name ## _id, value> name = #name;
+
+#define DEFINE_RULE(name, definition)						\
+	auto const name ## _def = definition;					\
+	BOOST_SPIRIT_DEFINE(name);
+	
+	namespace parser
+	{
+		using namespace x3;
+
+		// helpers
+		template <typename ItRange> std::string to_string(ItRange &range) { return std::string(range.begin(), range.end()); }
+
+		// comparison operators, matched longest first
+		struct comparison_operators : x3::symbols<ast::program::opcode>
+		{
+			comparison_operators()
+			{
+				for (ast::program::opcode op : { ast::program::CMP_EQ, ast::program::CMP_NE, ast::program::CMP_LT,
+				                                 ast::program::CMP_GT, ast::program::CMP_LE, ast::program::CMP_GE })
+					add(ast::program::operator_string(op), op);
+			}
+		} const comparison_operator;
+
+		// escaping filters
+		struct escape_filters : x3::symbols<escape_mode>
+		{
+			escape_filters()
+			{
+				add("raw", escape_mode::none)("html", escape_mode::html)("json", escape_mode::json)("url", escape_mode::url);
+			}
+		} const escape_filter;
+		
+		// semantic actions
+		auto empty_node = [](auto& ctx) { _val(ctx) = ast::node_ptr(); };
+		auto new_text = [](auto& ctx) { _val(ctx) = ast::node_ptr(new ast::text(to_string(_attr(ctx)))); };
+		auto new_reference = [](auto& ctx) { _val(ctx) = ast::node_ptr(new ast::reference(_attr(ctx))); };
+		auto new_variable = [](auto &ctx)
+		{
+			using boost::fusion::at_c;
+			_val(ctx) = at_c<0>(_attr(ctx));
+			if (at_c<1>(_attr(ctx))) _val(ctx)->template get<ast::reference>()->escape = *at_c<1>(_attr(ctx));
+		};
+		auto new_parent = [](auto& ctx) { _val(ctx) = ast::node_ptr(new ast::parent_node(_attr(ctx))); };
+		auto new_if_directive = [](auto &ctx) { _val(ctx) = ast::node_ptr(new ast::if_directive(_attr(ctx))); };
+		auto new_join_directive = [](auto &ctx) { _val(ctx) = ast::node_ptr(new ast::join_directive(_attr(ctx))); };
+        auto new_condition = [](auto &ctx)
+        {
+            using boost::fusion::at_c;
+            auto attr = _attr(ctx);
+            if (at_c<1>(attr)) _val(ctx) = ast::node_ptr(new ast::comparison_operator(at_c<1>(attr)->first, at_c<0>(attr), at_c<1>(attr)->second));
+            else _val(ctx) = at_c<0>(attr);
+        };
+    
+		// rules
+		DECLARE_RULE( tiny_template, ast::node_ptr )
+		DECLARE_RULE( template_part, ast::node_ptr )
+		DECLARE_RULE( directive, ast::node_ptr )
+		DECLARE_RULE( if_directive, ast::node_ptr )
+		DECLARE_RULE( condition, ast::node_ptr )
+		DECLARE_RULE( operation, std::pair<ast::program::opcode BOOST_PP_COMMA() ast::node_ptr> )
+		DECLARE_RULE( join_directive, ast::node_ptr )
+		DECLARE_RULE( value, ast::node_ptr )
+		DECLARE_RULE( variable, ast::node_ptr )
+		DECLARE_RULE( reference, ast::node_ptr )
+		DECLARE_RULE( identifier, std::string )
+		DECLARE_RULE( literal_string, ast::node_ptr )
+		DECLARE_RULE( plain_text, ast::node_ptr )
+        DECLARE_RULE( binary_operator, ast::program::opcode )
+
+		DEFINE_RULE( tiny_template, template_part >> eoi )
+		DEFINE_RULE( template_part, ( *( variable | directive | plain_text) ) [ new_parent ] )
+		DEFINE_RULE( directive, if_directive | join_directive )
+		DEFINE_RULE( if_directive, ( "{#if" >> omit[+space] >> condition >> '}' >> template_part >> *( "{#elseif" >> omit[+space] >> condition >> '}' >> template_part ) >> -( "{#else}" >> template_part ) >> "{#end}" ) [ new_if_directive ] )
+		DEFINE_RULE( condition, ( omit[*space] >> value >> omit[*space] >> -operation ) [new_condition] )
+		DEFINE_RULE( operation, binary_operator >> omit[*space] >> value )
+		DEFINE_RULE( join_directive, ( "{#join" >> omit[+space] >> reference >> omit[+space] >> "in" >> omit[+space] >> reference >> -( omit[+space >> "with" >> +space] >> value ) >> '}' >> template_part >> "{#end}" ) [ new_join_directive] )
+		DEFINE_RULE( value, reference | literal_string )
+		DEFINE_RULE( variable, ( '{' >> reference >> -( '|' >> escape_filter ) >> '}' ) [ new_variable ] )
+ 		DEFINE_RULE( reference, '$' >> ( identifier % '.' ) [ new_reference ] )
+		DEFINE_RULE( identifier, +( alnum | char_('_') ) )
+		DEFINE_RULE( literal_string, '\'' >> raw[ +(char_ - '\'') ] [ new_text ] >> '\'' ) // CB TODO - escaping apos
+		DEFINE_RULE( plain_text, raw[ +( char_ - '{' ) ] [ new_text ] )
+        DEFINE_RULE( binary_operator, comparison_operator )
+		
+	} // namespace parser
+	
+	ast::node_ptr ast::node::parse_spirit(const std::string &str)
+	{
+		node_ptr parsed;
+		std::string::const_iterator first = str.begin();
+		if (!x3::parse(first, str.end(), parser::template_part, parsed) || first != str.end())
+		{
+			throw parsing_error();
+		}
+		return parsed;
+	}
+
+#endif // TTL_NO_SPIRIT
+
+	// hand-written recursive descent parser, producing the same tree as the grammar above:
+	// each rule either matches and advances the position, or fails and restores it
+	namespace descent
+	{
+		class parser
+		{
+		public:
+			parser(std::string_view str, std::pmr::memory_resource *arena = nullptr, bool borrow = false, escape_mode escape = escape_mode::none)
+				: begin(str.data()), pos(begin), end(begin + str.size()), arena(arena), borrow(borrow), escape(escape)
+			{
+				for (const char *c = begin; c != end && (c = static_cast<const char *>(std::memchr(c, '\n', end - c))); ++c) newlines.push_back(c - begin);
+			}
+
+			// tiny_template: template_part eoi
+			ast::node_ptr parse()
+			{
+				ast::node_ptr parsed = template_part();
+				if (pos != end)
+				{
+					std::size_t offset = pos - begin;
+					std::size_t line = std::upper_bound(newlines.begin(), newlines.end(), offset) - newlines.begin();
+					std::size_t column = line ? offset - newlines[line - 1] : offset + 1;
+					throw parsing_error("parsing error at line " + std::to_string(line + 1) + ", column " + std::to_string(column));
+				}
+				return parsed;
+			}
+
+		private:
+			static bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+			static bool is_identifier(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'; }
+
+			bool literal(const char *lit, std::size_t len) { return scanning::match(pos, end, lit, len); }
+			template <std::size_t N> bool literal(const char (&lit)[N]) { return literal(lit, N - 1); }
+
+			// *space, or +space if required
+			bool spaces(bool required)
+			{
+				const char *start = pos;
+				while (pos != end && is_space(*pos)) ++pos;
+				return !required || pos != start;
+			}
+
+			// records the source position of a node, for render profiles
+			ast::node_ptr located(ast::node_ptr node, const char *at)
+			{
+				node->offset = at - begin;
+				node->line = std::upper_bound(newlines.begin(), newlines.end(), node->offset) - newlines.begin() + 1;
+				return node;
+			}
+
+			template <typename T, typename... Args> ast::node_ptr make(Args &&... args)
+			{
+				if (!arena) return std::make_shared<T>(std::forward<Args>(args)...);
+				return std::allocate_shared<T>(std::pmr::polymorphic_allocator<T>(arena), std::forward<Args>(args)...);
+			}
+
+			// text nodes of a borrowing tree view the source, and those of an arena tree
+			// view a copy of their chars in the arena
+			ast::node_ptr make_text(const char *from, const char *to)
+			{
+				if (borrow) return make<ast::text>(std::string_view(from, to - from));
+				if (!arena) return make<ast::text>(std::string(from, to));
+				char *chars = static_cast<char *>(arena->allocate(to - from, 1));
+				std::memcpy(chars, from, to - from);
+				return make<ast::text>(std::string_view(chars, to - from));
+			}
+
+			// template_part: *( variable | directive | plain_text )
+			ast::node_ptr template_part()
+			{
+				const char *start = pos;
+				std::vector<ast::node_ptr> children;
+				ast::node_ptr child;
+				while (pos != end)
+				{
+					if (*pos != '{')
+					{
+						// plain_text: +( char_ - '{' )
+						const char *brace = static_cast<const char *>(std::memchr(pos, '{', end - pos));
+						if (!brace) brace = end;
+						children.push_back(located(make_text(pos, brace), pos));
+						pos = brace;
+					}
+					else if (variable(child) || if_directive(child) || join_directive(child)) children.push_back(child);
+					else break;
+				}
+				return located(make<ast::parent_node>(std::move(children)), start);
+			}
+
+			// variable: '{' reference -( '|' escape_filter ) '}'
+			bool variable(ast::node_ptr &node)
+			{
+				const char *start = pos;
+				if (literal("{") && reference(node) && (!literal("|") || escape_filter(node->get<ast::reference>()->escape)) && literal("}"))
+				{
+					located(node, start);
+					return true;
+				}
+				pos = start;
+				return false;
+			}
+
+			// escape_filter: "raw" | "html" | "json" | "url"
+			bool escape_filter(escape_mode &mode)
+			{
+				if (literal("raw")) mode = escape_mode::none;
+				else if (literal("html")) mode = escape_mode::html;
+				else if (literal("json")) mode = escape_mode::json;
+				else if (literal("url")) mode = escape_mode::url;
+				else return false;
+				return true;
+			}
+
+			// reference: '$' ( identifier % '.' )
+			bool reference(ast::node_ptr &node)
+			{
+				const char *start = pos;
+				std::vector<std::string> identifiers;
+				std::string id;
+				if (literal("$") && identifier(id))
+				{
+					identifiers.push_back(id);
+					for (;;)
+					{
+						const char *dot = pos;
+						if (!literal(".") || !identifier(id))
+						{
+							pos = dot;
+							break;
+						}
+						identifiers.push_back(id);
+					}
+					node = make<ast::reference>(identifiers, escape);
+					return true;
+				}
+				pos = start;
+				return false;
+			}
+
+			// identifier: +( alnum | '_' )
+			bool identifier(std::string &id)
+			{
+				const char *start = pos;
+				while (pos != end && is_identifier(*pos)) ++pos;
+				id.assign(start, pos);
+				return pos != start;
+			}
+
+			// literal_string: '\'' +( char_ - '\'' ) '\''
+			bool literal_string(ast::node_ptr &node)
+			{
+				if (pos == end || *pos != '\'') return false;
+				const char *quote = static_cast<const char *>(std::memchr(pos + 1, '\'', end - pos - 1));
+				if (!quote || quote == pos + 1) return false;
+				node = make_text(pos + 1, quote);
+				pos = quote + 1;
+				return true;
+			}
+
+			// value: reference | literal_string
+			bool value(ast::node_ptr &node)
+			{
+				const char *start = pos;
+				if (!reference(node) && !literal_string(node)) return false;
+				located(node, start);
+				return true;
+			}
+
+			// condition: *space value *space -( binary_operator *space value )
+			// binary_operator: "==" | "!=" | "<=" | ">=" | '<' | '>'
+			bool condition(ast::node_ptr &node)
+			{
+				const char *start = pos;
+				spaces(false);
+				if (!value(node))
+				{
+					pos = start;
+					return false;
+				}
+				spaces(false);
+				const char *op = pos;
+				ast::node_ptr right;
+				ast::program::opcode cmp;
+				if (binary_operator(cmp) && spaces(false) && value(right)) node = make<ast::comparison_operator>(cmp, node, right);
+				else pos = op;
+				return true;
+			}
+
+			bool binary_operator(ast::program::opcode &op)
+			{
+				std::size_t length = end - pos >= 2 && pos[1] == '=' ? 2 : 1;
+				if (pos == end || !ast::program::comparison(std::string_view(pos, length), op)) return false;
+				pos += length;
+				return true;
+			}
+
+			// if_directive: "{#if" +space condition '}' template_part
+			//               *( "{#elseif" +space condition '}' template_part )
+			//               -( "{#else}" template_part ) "{#end}"
+			bool if_directive(ast::node_ptr &node)
+			{
+				const char *start = pos;
+				std::vector<ast::node_ptr> conditions, parts;
+				ast::node_ptr cond;
+				if (literal("{#if") && spaces(true) && condition(cond) && literal("}"))
+				{
+					conditions.push_back(cond);
+					parts.push_back(template_part());
+					for (;;)
+					{
+						const char *elseif = pos;
+						if (!(literal("{#elseif") && spaces(true) && condition(cond) && literal("}")))
+						{
+							pos = elseif;
+							break;
+						}
+						conditions.push_back(cond);
+						parts.push_back(template_part());
+					}
+					if (literal("{#else}")) parts.push_back(template_part());
+					if (literal("{#end}"))
+					{
+						node = located(make<ast::if_directive>(std::move(conditions), std::move(parts)), start);
+						return true;
+					}
+				}
+				pos = start;
+				return false;
+			}
+
+			// join_directive: "{#join" +space reference +space "in" +space reference
+			//                 -( +space "with" +space value ) '}' template_part "{#end}"
+			bool join_directive(ast::node_ptr &node)
+			{
+				const char *start = pos;
+				ast::node_ptr iterator, collection, separator;
+				if (literal("{#join") && spaces(true) && reference(iterator) && spaces(true) && literal("in") && spaces(true) && reference(collection))
+				{
+					const char *with = pos;
+					if (!(spaces(true) && literal("with") && spaces(true) && value(separator)))
+					{
+						separator.reset();
+						pos = with;
+					}
+					if (literal("}"))
+					{
+						ast::node_ptr content = template_part();
+						if (literal("{#end}"))
+						{
+							node = located(make<ast::join_directive>(iterator, collection, separator, content), start);
+							return true;
+						}
+					}
+				}
+				pos = start;
+				return false;
+			}
+
+			const char *begin;
+			const char *pos;
+			const char *end;
+			std::pmr::memory_resource *arena;
+			bool borrow;
+			escape_mode escape; // default escaping of references
+			std::vector<std::size_t> newlines; // offsets
+		};
+
+	} // namespace descent
+
+	ast::node_ptr ast::node::parse(const std::string &str, std::pmr::memory_resource *arena, escape_mode escape)
+	{
+		return descent::parser(str, arena, false, escape).parse();
+	}
+
+	ast::node_ptr ast::node::parse_borrowed(std::string_view source, std::pmr::memory_resource *arena, escape_mode escape)
+	{
+		return descent::parser(source, arena, true, escape).parse();
+	}
+
+	// template
+
+	tiny_template::tiny_template(ast::node_ptr root, std::shared_ptr<const void> storage, std::string_view source) : storage(storage), root(root)
+	{
+		static std::atomic<std::uint64_t> last_id(0);
+		id = ++last_id;
+#ifdef TTL_PROFILE
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#endif
+		ast::compiler c(symbol_ids, slot_paths, dependency_paths);
+		root->compile(c);
+		std::shared_ptr<ast::program> prog = std::make_shared<ast::program>();
+		prog->source = source;
+		ast::assembler a(*prog);
+		root->assemble(a);
+		bytecode = prog;
+		hint = prog->estimated_size;
+#ifdef TTL_PROFILE
+		metrics.compile = std::chrono::steady_clock::now() - start;
+		metrics.source_size = source.size();
+		metrics.nodes = ast::optimizer::count(*root);
+#endif
+	}
+
+	std::size_t tiny_template::static_size() const
+	{
+		return bytecode->estimated_size;
+	}
+
+	void tiny_template::learn(std::size_t size) const
+	{
+		// growths at most double the hint, and shrinkages halve the difference, so that steady
+		// sizes are reached in a few renders while a single outlier neither pins a large hint
+		// nor makes the next renders reserve much more than they need; concurrent updates may
+		// get lost, which is harmless for a hint
+		const std::size_t min_growth = 1024;
+		std::size_t current = hint.load(std::memory_order_relaxed);
+		std::size_t learned = size >= current ? std::min(size, current + std::max(current, min_growth)) : current - (current - size + 1) / 2;
+		if (learned != current) hint.store(learned, std::memory_order_relaxed);
+	}
+
+	template <typename Render> std::string tiny_template::render_string(Render render) const
+	{
+		std::string ret;
+		ret.reserve(size_hint());
+		string_sink out(ret);
+		render(out);
+		learn(ret.size());
+		return ret;
+	}
+
+	tiny_template_ptr tiny_template::parse(const std::string &str, const parse_options &options)
+	{
+		// the source size is a fair guess of the tree size; the arena grows as needed
+		std::shared_ptr<std::pmr::monotonic_buffer_resource> arena;
+		if (options.arena) arena = std::make_shared<std::pmr::monotonic_buffer_resource>(str.size() + 1024);
+#ifdef TTL_PROFILE
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#endif
+		ast::node_ptr root = ast::node::parse(str, arena.get(), options.escape);
+		if (options.optimize) ast::node::optimize(root);
+#ifdef TTL_PROFILE
+		std::chrono::nanoseconds parsing = std::chrono::steady_clock::now() - start;
+#endif
+		tiny_template_ptr tmpl = std::make_shared<tiny_template>(root, arena);
+#ifdef TTL_PROFILE
+		tmpl->metrics.parse = parsing;
+		tmpl->metrics.source_size = str.size();
+#endif
+		return tmpl;
+	}
+
+	namespace files
+	{
+		// read-only mapping of a whole file
+		class mapped_file
+		{
+		public:
+			mapped_file(const std::string &path) : data(nullptr), size(0)
+			{
+#ifdef _WIN32
+				// no mapping on Windows, the file is read
+				std::ifstream in(path, std::ios::binary);
+				if (!in) throw parsing_error("cannot read template file '" + path + "'");
+				buffer.assign((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+				data = buffer.data();
+				size = buffer.size();
+#else
+				int fd = ::open(path.c_str(), O_RDONLY);
+				struct stat info;
+				if (fd < 0 || ::fstat(fd, &info) < 0)
+				{
+					if (fd >= 0) ::close(fd);
+					throw parsing_error("cannot read template file '" + path + "'");
+				}
+				size = static_cast<std::size_t>(info.st_size);
+				if (size)
+				{
+					void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+					if (mapping == MAP_FAILED)
+					{
+						::close(fd);
+						throw parsing_error("cannot map template file '" + path + "'");
+					}
+					data = static_cast<const char *>(mapping);
+				}
+				::close(fd);
+#endif
+			}
+			~mapped_file()
+			{
+#ifndef _WIN32
+				if (data) ::munmap(const_cast<char *>(data), size);
+#endif
+			}
+			mapped_file(const mapped_file &) = delete;
+			mapped_file & operator = (const mapped_file &) = delete;
+			std::string_view contents() const { return std::string_view(data, size); }
+		private:
+			const char *data;
+			std::size_t size;
+#ifdef _WIN32
+			std::string buffer;
+#endif
+		};
+	}
+
+	tiny_template_ptr tiny_template::parse_file(const std::string &path, const parse_options &options)
+	{
+		struct file_storage
+		{
+			file_storage(const std::string &path) : file(path) {}
+			files::mapped_file file;
+			std::unique_ptr<std::pmr::monotonic_buffer_resource> arena;
+		};
+		std::shared_ptr<file_storage> storage = std::make_shared<file_storage>(path);
+		std::string_view source = storage->file.contents();
+		if (options.arena) storage->arena.reset(new std::pmr::monotonic_buffer_resource(source.size() / 2 + 1024));
+#ifdef TTL_PROFILE
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#endif
+		ast::node_ptr root = ast::node::parse_borrowed(source, storage->arena.get(), options.escape);
+		if (options.optimize) ast::node::optimize(root);
+#ifdef TTL_PROFILE
+		std::chrono::nanoseconds parsing = std::chrono::steady_clock::now() - start;
+#endif
+		tiny_template_ptr tmpl = std::make_shared<tiny_template>(root, storage, source);
+#ifdef TTL_PROFILE
+		tmpl->metrics.parse = parsing;
+#endif
+		return tmpl;
+	}
+
+	std::string tiny_template::evaluate(const context &ctx) const
+	{
+		return render_string([&](sink &out) { evaluate_to(out, ctx); });
+	}
+
+	std::string tiny_template::evaluate(const indexed_context &ctx) const
+	{
+		return render_string([&](sink &out) { evaluate_to(out, ctx); });
+	}
+
+	void tiny_template::evaluate_to(sink &out, const context &ctx, scratch_arena *scratch) const
+	{
+		std::pmr::memory_resource *resource = scratch ? scratch->resource() : std::pmr::get_default_resource();
+		ast::lazy_store lazy(resource);
+		root->evaluate_to(out, ast::scope(ctx, nullptr, resource, &lazy));
+	}
+
+	void tiny_template::evaluate_to(sink &out, const indexed_context &ctx, scratch_arena *scratch) const
+	{
+		if (&ctx.owner() != this) throw evaluation_error("indexed context bound to another template");
+		std::pmr::memory_resource *resource = scratch ? scratch->resource() : std::pmr::get_default_resource();
+		ast::lazy_store lazy(resource);
+		root->evaluate_to(out, ast::scope(ctx.params(), &ctx, resource, &lazy));
+	}
+
+	std::string tiny_template::evaluate(const context &ctx, render_memo &memo) const
+	{
+		return render_string([&](sink &out) { evaluate_to(out, ctx, memo); });
+	}
+
+	void tiny_template::evaluate_to(sink &out, const context &ctx, render_memo &memo) const
+	{
+		if (memo.owner != id)
+		{
+			memo.clear();
+			memo.owner = id;
+		}
+		memo.slot_hashes.resize(slot_paths.size());
+		memo.hashed.assign(slot_paths.size(), false);
+		ast::lazy_store lazy;
+		ast::scope root_scope(ctx, nullptr, nullptr, &lazy);
+		ast::memoizer memoizer(memo, *this, root_scope);
+		root_scope.memo = &memoizer;
+		root->evaluate_to(out, root_scope);
+	}
+
+	std::string tiny_template::evaluate(const context &ctx, const parallel_options &parallel) const
+	{
+		return render_string([&](sink &out) { evaluate_to(out, ctx, parallel); });
+	}
+
+	void tiny_template::evaluate_to(sink &out, const context &ctx, const parallel_options &parallel) const
+	{
+		ast::lazy_store lazy;
+		ast::scope root_scope(ctx, nullptr, nullptr, &lazy);
+		root_scope.parallel = &parallel;
+		root->evaluate_to(out, root_scope);
+	}
+
+#ifdef TTL_PROFILE
+	std::string tiny_template::evaluate(const context &ctx, render_profile &profile) const
+	{
+		return render_string([&](sink &out) { evaluate_to(out, ctx, profile); });
+	}
+
+	void tiny_template::evaluate_to(sink &out, const context &ctx, render_profile &profile) const
+	{
+		ast::lazy_store lazy;
+		ast::profiler profiler(profile);
+		ast::scope root_scope(ctx, nullptr, nullptr, &lazy);
+		root_scope.profile = &profiler;
+		ast::render(*root, out, root_scope);
+	}
+
+	std::vector<render_profile::entry> render_profile::entries() const
+	{
+		std::vector<entry> ret;
+		ret.reserve(nodes.size());
+		for (const auto &node : nodes) ret.push_back(node.second);
+		std::sort(ret.begin(), ret.end(), [](const entry &a, const entry &b) { return a.offset < b.offset || (a.offset == b.offset && a.inclusive > b.inclusive); });
+		return ret;
+	}
+
+	void render_profile::report(std::ostream &out) const
+	{
+		std::vector<entry> sorted = entries();
+		std::stable_sort(sorted.begin(), sorted.end(), [](const entry &a, const entry &b) { return a.exclusive > b.exclusive; });
+		std::ios_base::fmtflags flags = out.flags();
+		std::streamsize precision = out.precision();
+		out << "exclusive us  inclusive us     calls       bytes  allocations   line  node\n" << std::fixed << std::setprecision(1);
+		for (const entry &e : sorted)
+		{
+			out << std::setw(12) << e.exclusive.count() / 1000.0 << std::setw(14) << e.inclusive.count() / 1000.0
+				<< std::setw(10) << e.calls << std::setw(12) << e.bytes << std::setw(13) << e.allocations
+				<< std::setw(7) << e.line << "  " << e.label << "\n";
+		}
+		out.flags(flags);
+		out.precision(precision);
+	}
+
+	void render_profile::flame_graph(std::ostream &out) const
+	{
+		for (const auto &stack : stacks)
+		{
+			for (std::size_t i = 0; i < stack.first.size(); ++i)
+			{
+				const entry &e = nodes.at(stack.first[i]);
+				out << (i ? ";" : "") << e.label << " (line " << e.line << ")";
+			}
+			out << " " << stack.second.count() << "\n";
+		}
+	}
+
+	void render_profile::clear()
+	{
+		nodes.clear();
+		stacks.clear();
+	}
+#endif
+
+	// ahead-of-time compilation
+
+	namespace generated
+	{
+		render_state::render_state(const context &ctx) : lazy(new ast::lazy_store), params(ctx, nullptr, nullptr, lazy.get()) {}
+
+		render_state::~render_state() {}
+
+		const value * render_state::find(const std::string &key) const
+		{
+			return params.find(key);
+		}
+
+		const value & render_state::resolve(const value *first, const std::string *path, std::size_t size) const
+		{
+			return ast::reference::walk(first, path, size, params);
+		}
+
+		bool render_state::test(const value *first, const std::string *path, std::size_t size) const
+		{
+			const value *prop;
+			try { prop = &resolve(first, path, size); } catch (std::exception &) { return false; }
+			return prop->test();
+		}
+
+		void render_state::write(sink &out, const value &val, escape_mode mode) const
+		{
+			ast::reference::write(out, val, mode);
+		}
+
+		int render_state::compare(const value &left, const value &right)
+		{
+			char left_buffer[ast::reference::format_size], right_buffer[ast::reference::format_size];
+			return ast::comparand::compare(ast::reference::compared(left, left_buffer), ast::reference::compared(right, right_buffer));
+		}
+
+		std::pair<const value *, const value *> render_state::items(const value &collection)
+		{
+			if (!collection.is_vector()) return std::make_pair(&collection, &collection + 1);
+			const vector &v = collection.as_vector();
+			return std::make_pair(v.data(), v.data() + v.size());
+		}
+	}
+
+	namespace codegen
+	{
+		// C++ literal of a string, split after new lines
+		std::string quoted(std::string_view str, const std::string &indent)
+		{
+			std::string ret = "\"";
+			for (std::size_t i = 0; i < str.size(); ++i)
+			{
+				unsigned char c = static_cast<unsigned char>(str[i]);
+				switch (c)
+				{
+					case '"': ret += "\\\""; break;
+					case '\\': ret += "\\\\"; break;
+					case '\t': ret += "\\t"; break;
+					case '\r': ret += "\\r"; break;
+					case '\n':
+						ret += "\\n";
+						if (i + 1 != str.size()) ret += "\"\n" + indent + "\"";
+						break;
+					default:
+						if (c < 0x20 || c >= 0x7F)
+						{
+							// octal escapes stop after 3 digits, unlike hexadecimal ones
+							char octal[5] = { '\\', char('0' + (c >> 6)), char('0' + ((c >> 3) & 7)), char('0' + (c & 7)), 0 };
+							ret += octal;
+						}
+						else ret += char(c);
+				}
+			}
+			return ret + "\"";
+		}
+
+		// body of a render function, statement by statement
+		class generator
+		{
+		public:
+			generator() : depth(1), count(0), writes(false) {}
+
+			void statement(const ast::node &n)
+			{
+				if (const ast::parent_node *parent = n.get<ast::parent_node>())
+				{
+					for (const ast::node_ptr &child : parent->children) statement(*child);
+				}
+				else if (const ast::text *literal = n.get<ast::text>())
+				{
+					if (literal->value.empty()) return;
+					std::string id = name("text");
+					line("static constexpr std::string_view " + id + " = " + quoted(literal->value, indent() + "    ") + ";");
+					line("out.write(" + id + ".data(), " + id + ".size());");
+					writes = true;
+				}
+				else if (const ast::reference *ref = n.get<ast::reference>())
+				{
+					line("state.write(out, " + resolve(*ref) + ", ttl::escape_mode::" + escape_name(ref->escape) + ");");
+					writes = true;
+				}
+				else if (const ast::if_directive *directive = n.get<ast::if_directive>())
+				{
+					// operands are declared ahead of the whole if/else chain
+					std::vector<std::string> conditions;
+					for (const ast::node_ptr &cond : directive->condition_nodes) conditions.push_back(condition(*cond));
+					for (std::size_t i = 0; i < directive->part_nodes.size(); ++i)
+					{
+						if (i < conditions.size()) line((i ? "else if (" : "if (") + conditions[i] + ")");
+						else line("else");
+						block(*directive->part_nodes[i]);
+					}
+				}
+				else if (const ast::join_directive *directive = n.get<ast::join_directive>())
+				{
+					line("{");
+					++depth;
+					std::string items = name("items"), item = name("item");
+					line("std::pair<const ttl::value *, const ttl::value *> " + items + " = ttl::generated::render_state::items(" +
+						resolve(*directive->collection->get<ast::reference>()) + ");");
+					line("for (const ttl::value *" + item + " = " + items + ".first; " + item + " != " + items + ".second; ++" + item + ")");
+					line("{");
+					++depth;
+					if (directive->separator)
+					{
+						// the separator is outside of the loop variable scope
+						line("if (" + item + " != " + items + ".first)");
+						block(*directive->separator);
+					}
+					iterators.push_back(std::make_pair(directive->iterator->get<ast::reference>()->identifiers[0], item));
+					statement(*directive->content);
+					iterators.pop_back();
+					--depth;
+					line("}");
+					--depth;
+					line("}");
+				}
+				else throw evaluation_error("cannot generate code for " + n.debug());
+			}
+
+			std::string code;
+			bool writes; // whether the code uses the sink
+
+		private:
+			std::string indent() const { return std::string(depth * 4, ' '); }
+			void line(const std::string &text) { code += indent() + text + "\n"; }
+			std::string name(const char *prefix) { return prefix + std::string("_") + std::to_string(++count); }
+
+			void block(const ast::node &n)
+			{
+				line("{");
+				++depth;
+				statement(n);
+				--depth;
+				line("}");
+			}
+
+			static const char * escape_name(escape_mode mode)
+			{
+				switch (mode)
+				{
+					case escape_mode::html: return "html";
+					case escape_mode::json: return "json";
+					case escape_mode::url: return "url";
+					default: return "none";
+				}
+			}
+
+			// declares the path of a reference, and returns the value of its first identifier:
+			// the innermost loop variable of that name, or else the context entry
+			std::string path(const ast::reference &ref)
+			{
+				std::string id = name("path"), list;
+				for (const std::string &identifier : ref.identifiers) list += (list.empty() ? "" : ", ") + quoted(identifier, "");
+				line("static const std::string " + id + "[] = { " + list + " };");
+				for (auto it = iterators.rbegin(); it != iterators.rend(); ++it)
+				{
+					if (it->first == ref.identifiers[0]) return it->second + ", " + id + ", " + std::to_string(ref.identifiers.size());
+				}
+				return "state.find(" + id + "[0]), " + id + ", " + std::to_string(ref.identifiers.size());
+			}
+
+			std::string resolve(const ast::reference &ref) { return "state.resolve(" + path(ref) + ")"; }
+
+			// comparison operand
+			std::string operand(const ast::node &n)
+			{
+				if (const ast::reference *ref = n.get<ast::reference>()) return resolve(*ref);
+				std::string id = name("literal");
+				line("static const ttl::value " + id + "(std::string_view(" + quoted(n.get<ast::text>()->value, "") + "));");
+				return id;
+			}
+
+			std::string condition(const ast::node &cond)
+			{
+				if (const ast::reference *ref = cond.get<ast::reference>()) return "state.test(" + path(*ref) + ")";
+				if (const ast::text *literal = cond.get<ast::text>()) return literal->value.empty() ? "false" : "true";
+				const ast::binary_operator &op = *cond.get<ast::binary_operator>();
+				std::string left = operand(*op.left), right = operand(*op.right);
+				return "ttl::generated::render_state::compare(" + left + ", " + right + ") " + op.operator_string() + " 0";
+			}
+
+			std::size_t depth;
+			std::size_t count;
+			std::vector<std::pair<std::string, std::string>> iterators; // loop variable names, and their C++ variable
 		};
-		
-	} // namespace ast
+	}
 
-	// Grammar
-	
-#define DECLARE_RULE(name, value)							 \
-	struct name ## _id;													 \
-	rule<name ## _id, value> name = #name;
+	std::string generate_cpp(const tiny_template &tmpl, const std::string &name)
+	{
+		codegen::generator g;
+		g.statement(*tmpl.root);
+		// the sink is left unnamed if unused, for the header to compile without warnings
+		return
+			"// generated from a tiny-template, do not edit\n"
+			"#pragma once\n"
+			"#include <string>\n"
+			"#include <string_view>\n"
+			"#include <utility>\n"
+			"#include \"tiny_template.h\"\n"
+			"\n"
+			"inline void " + name + "(ttl::sink &" + (g.writes ? "out" : "") + ", const ttl::context &ctx)\n"
+			"{\n"
+			"    ttl::generated::render_state state(ctx);\n" +
+			g.code +
+			"}\n"
+			"\n"
+			"inline std::string " + name + "(const ttl::context &ctx)\n"
+			"{\n"
+			"    std::string ret;\n"
+			"    ret.reserve(" + std::to_string(tmpl.static_size()) + ");\n"
+			"    ttl::string_sink out(ret);\n"
+			"    " + name + "(out, ctx);\n"
+			"    return ret;\n"
+			"}\n";
+	}
 
-#define DEFINE_RULE(name, definition)						\
-	auto const name ## _def = definition;					\
-	BOOST_SPIRIT_DEFINE(name);
-	
-	namespace parser
+	void tiny_template::evaluate_batch(const context *contexts, std::size_t count, const batch_sink &out, thread_pool *pool) const
 	{
-		using namespace x3;
+		if (!pool || !pool->size())
+		{
+			std::string buffer;
+			scratch_arena scratch;
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				std::exception_ptr error = render_item(contexts[i], buffer, scratch);
+				out(i, error ? std::string_view() : std::string_view(buffer), error);
+			}
+			return;
+		}
+		// render windows of items in parallel, by chunks, then report them in order
+		const std::size_t chunk = 16;
+		std::size_t window = std::min(count, (pool->size() + 1) * 4 * chunk);
+		std::vector<std::string> outputs(window);
+		std::vector<std::exception_ptr> errors(window);
+		for (std::size_t start = 0; start < count; start += window)
+		{
+			std::size_t size = std::min(window, count - start);
+			pool->parallel_for((size + chunk - 1) / chunk, [&](std::size_t c)
+			{
+				scratch_arena scratch;
+				for (std::size_t i = c * chunk; i < std::min(size, (c + 1) * chunk); ++i)
+					errors[i] = render_item(contexts[start + i], outputs[i], scratch);
+			});
+			for (std::size_t i = 0; i < size; ++i) out(start + i, errors[i] ? std::string_view() : std::string_view(outputs[i]), errors[i]);
+		}
+	}
 
-		// helpers
-		template <typename ItRange> std::string to_string(ItRange &range) { return std::string(range.begin(), range.end()); }
-		
-		// semantic actions
-		auto empty_node = [](auto& ctx) { _val(ctx) = ast::node_ptr(); };
-		auto new_text = [](auto& ctx) { _val(ctx) = ast::node_ptr(new ast::text(to_string(_attr(ctx)))); };
-		auto new_reference = [](auto& ctx) { _val(ctx) = ast::node_ptr(new ast::reference(_attr(ctx))); };
-		auto new_parent = [](auto& ctx) { _val(ctx) = ast::node_ptr(new ast::parent_node(_attr(ctx))); };
-		auto new_if_directive = [](auto &ctx) { _val(ctx) = ast::node_ptr(new ast::if_directive(_attr(ctx))); };
-		auto new_join_directive = [](auto &ctx) { _val(ctx) = ast::node_ptr(new ast::join_directive(_attr(ctx))); };
-        auto new_condition = [](auto &ctx)
-        {
-            using boost::fusion::at_c;
-            auto attr = _attr(ctx);
-            if (at_c<1>(attr)) _val(ctx) = ast::node_ptr(new ast::equals_operator(at_c<0>(attr), *at_c<1>(attr)));
-            else _val(ctx) = at_c<0>(attr);
-        };
-    
-		// rules
-		DECLARE_RULE( tiny_template, ast::node_ptr )
-		DECLARE_RULE( template_part, ast::node_ptr )
-		DECLARE_RULE( directive, ast::node_ptr )
-		DECLARE_RULE( if_directive, ast::node_ptr )
-		DECLARE_RULE( condition, ast::node_ptr )
-		DECLARE_RULE( join_directive, ast::node_ptr )
-		DECLARE_RULE( value, ast::node_ptr )
-		DECLARE_RULE( variable, ast::node_ptr )
-		DECLARE_RULE( reference, ast::node_ptr )
-		DECLARE_RULE( identifier, std::string )
-		DECLARE_RULE( literal_string, ast::node_ptr )
-		DECLARE_RULE( plain_text, ast::node_ptr )
-        DECLARE_RULE( binary_operator, ast::node_ptr )
+	std::exception_ptr tiny_template::render_item(const context &ctx, std::string &buffer, scratch_arena &scratch) const
+	{
+		buffer.clear(); // keeps the capacity of previous items
+		if (buffer.capacity() < size_hint()) buffer.reserve(size_hint());
+		string_sink out(buffer);
+		std::exception_ptr error;
+		try
+		{
+			execute_to(out, ctx, &scratch);
+			learn(buffer.size());
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+		scratch.reset();
+		return error;
+	}
 
-		DEFINE_RULE( tiny_template, template_part >> eoi )
-		DEFINE_RULE( template_part, ( *( variable | directive | plain_text) ) [ new_parent ] )
-		DEFINE_RULE( directive, if_directive | join_directive )
-		DEFINE_RULE( if_directive, ( "{#if" >> omit[+space] >> condition >> '}' >> template_part >> *( "{#elseif" >> omit[+space] >> condition >> '}' >> template_part ) >> -( "{#else}" >> template_part ) >> "{#end}" ) [ new_if_directive ] )
-		// CB TODO - only supported conditions, for now, are a boolean check on a reference and the equality operator "=="
-		DEFINE_RULE( condition, ( omit[*space] >> value >> omit[*space] >> -( omit[raw["=="]] >> omit[*space] >> value ) ) [new_condition] )
-		DEFINE_RULE( join_directive, ( "{#join" >> omit[+space] >> reference >> omit[+space] >> "in" >> omit[+space] >> reference >> -( omit[+space >> "with" >> +space] >> value ) >> '}' >> template_part >> "{#end}" ) [ new_join_directive] )
-		DEFINE_RULE( value, reference | literal_string )
-		DEFINE_RULE( variable, '{' >> reference >> '}' )
- 		DEFINE_RULE( reference, '$' >> ( identifier % '.' ) [ new_reference ] )
-		DEFINE_RULE( identifier, +( alnum | char_('_') ) )
-		DEFINE_RULE( literal_string, '\'' >> raw[ +(char_ - '\'') ] [ new_text ] >> '\'' ) // CB TODO - escaping apos
-		DEFINE_RULE( plain_text, raw[ +( char_ - '{' ) ] [ new_text ] )
-        // DEFINE_RULE( binary_operator, ( raw["=="] | ... ) [ new_text ] ) TODO
-		
-	} // namespace parser
-	
-	ast::node_ptr ast::node::parse(const std::string &str)
+	std::string tiny_template::execute(const context &ctx) const
 	{
-		node_ptr parsed;
+		return render_string([&](sink &out) { execute_to(out, ctx); });
+	}
+
+	std::string tiny_template::execute(const indexed_context &ctx) const
+	{
+		return render_string([&](sink &out) { execute_to(out, ctx); });
+	}
+
+	void tiny_template::execute_to(sink &out, const context &ctx, scratch_arena *scratch) const
+	{
+		std::pmr::memory_resource *resource = scratch ? scratch->resource() : std::pmr::get_default_resource();
+		ast::lazy_store lazy(resource);
+		bytecode->run(out, ast::scope(ctx, nullptr, resource, &lazy));
+	}
+
+	void tiny_template::execute_to(sink &out, const indexed_context &ctx, scratch_arena *scratch) const
+	{
+		if (&ctx.owner() != this) throw evaluation_error("indexed context bound to another template");
+		std::pmr::memory_resource *resource = scratch ? scratch->resource() : std::pmr::get_default_resource();
+		ast::lazy_store lazy(resource);
+		bytecode->run(out, ast::scope(ctx.params(), &ctx, resource, &lazy));
+	}
+
+	std::size_t tiny_template::execute_to(char *buffer, std::size_t capacity, const context &ctx) const
+	{
+		buffer_sink out(buffer, capacity);
+		execute_to(out, ctx);
+		return out.required();
+	}
+
+	std::string tiny_template::debug() const
+	{
+		return root->debug();
+	}
 
-		if (!x3::parse(str.begin(), str.end(), parser::template_part, parsed))
+	indexed_context::indexed_context(const tiny_template &tmpl, const context &ctx) : tmpl(tmpl), ctx(ctx)
+	{
+		const symbol_table &symbols = tmpl.symbols();
+		values.reserve(tmpl.slots().size());
+		for (const tiny_template::path &path : tmpl.slots())
 		{
-			throw parsing_error();
+			const value *prop = nullptr;
+			const map *m = &ctx;
+			for (std::size_t id : path)
+			{
+				if (!m) { prop = nullptr; break; }
+				map::const_iterator it = m->find(symbols.name(id));
+				if (it == m->end()) { prop = nullptr; break; }
+				prop = &it->second;
+				m = prop->is_map() ? &prop->as_map() : nullptr;
+			}
+			values.push_back(prop);
 		}
-		return parsed;
 	}
 	
+	// template file
+
+	template_file::template_file(const std::string &path, const parse_options &options) : path(path), options(options)
+	{
+		refresh();
+	}
+
+	bool template_file::refresh()
+	{
+		std::lock_guard<std::mutex> lock(reload);
+		std::error_code error;
+		std::filesystem::file_time_type time = std::filesystem::last_write_time(path, error);
+		std::uintmax_t size = error ? 0 : std::filesystem::file_size(path, error);
+		if (error) throw parsing_error("cannot read template file '" + path + "'");
+		if (std::atomic_load(&current) && time == modified && size == file_size) return false;
+		tiny_template_ptr tmpl = tiny_template::parse_file(path, options);
+		modified = time;
+		file_size = size;
+		std::atomic_store(&current, tmpl);
+		return true;
+	}
+
+	// chunked renderer
+
+	struct chunked_renderer::state
+	{
+		state(const tiny_template &tmpl, const context &ctx, std::size_t chunk_size)
+			: bytecode(tmpl.bytecode), root(ctx, nullptr, nullptr, &lazy), pos(*bytecode, root), chunk_size(chunk_size ? chunk_size : 1), consumed(0), finished(false) {}
+		std::shared_ptr<const ast::program> bytecode;
+		ast::lazy_store lazy;
+		ast::scope root;
+		ast::program::cursor pos;
+		std::size_t chunk_size;
+		std::string buffer; // output produced, from the consumed offset
+		std::size_t consumed;
+		bool finished;
+	};
+
+	chunked_renderer::chunked_renderer(const tiny_template &tmpl, const context &ctx, std::size_t chunk_size)
+		: current(new state(tmpl, ctx, chunk_size))
+	{
+	}
+
+	chunked_renderer::~chunked_renderer()
+	{
+	}
+
+	std::string_view chunked_renderer::next()
+	{
+		state &st = *current;
+		st.buffer.erase(0, st.consumed);
+		st.consumed = 0;
+		if (!st.finished && st.buffer.size() < st.chunk_size)
+		{
+			// instructions are run until a full chunk is available, so the buffer only exceeds
+			// it by the output of a single instruction
+			string_sink out(st.buffer);
+			try
+			{
+				st.finished = st.bytecode->run(out, st.pos, [&st]() { return st.buffer.size() >= st.chunk_size; });
+			}
+			catch (...)
+			{
+				st.finished = true;
+				st.buffer.clear();
+				throw;
+			}
+		}
+		st.consumed = std::min(st.chunk_size, st.buffer.size());
+		return std::string_view(st.buffer.data(), st.consumed);
+	}
+
+	bool chunked_renderer::done() const
+	{
+		return current->finished && current->consumed == current->buffer.size();
+	}
+
+	// thread pool
+
+	struct thread_pool::job
+	{
+		job(std::size_t count, const std::function<void(std::size_t)> &task) : count(count), task(task), next(0), done(0), failed(false) {}
+
+		// runs claimed indices until none is left
+		void run()
+		{
+			for (std::size_t i; (i = next.fetch_add(1)) < count; )
+			{
+				if (!failed.load())
+				{
+					try { task(i); }
+					catch (...)
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						if (!error) error = std::current_exception();
+						failed = true;
+					}
+				}
+				if (done.fetch_add(1) + 1 == count)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					finished.notify_all();
+				}
+			}
+		}
+
+		std::size_t count;
+		const std::function<void(std::size_t)> &task; // only called while parallel_for waits
+		std::atomic<std::size_t> next, done;
+		std::atomic<bool> failed;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable finished;
+	};
+
+	thread_pool::thread_pool(std::size_t threads)
+	{
+		for (std::size_t i = 0; i < threads; ++i) workers.emplace_back([this]() { work(); });
+	}
+
+	thread_pool::~thread_pool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		for (std::thread &worker : workers) worker.join();
+	}
+
+	void thread_pool::work()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;)
+		{
+			wakeup.wait(lock, [this]() { return stopping || !jobs.empty(); });
+			if (jobs.empty()) return;
+			std::shared_ptr<job> current = jobs.front();
+			if (current->next.load() >= current->count)
+			{
+				// every index is claimed
+				jobs.pop_front();
+				continue;
+			}
+			lock.unlock();
+			current->run();
+			lock.lock();
+		}
+	}
+
+	void thread_pool::parallel_for(std::size_t count, const std::function<void(std::size_t)> &task)
+	{
+		if (!count) return;
+		std::shared_ptr<job> current = std::make_shared<job>(count, task);
+		if (count > 1 && !workers.empty())
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(current);
+			wakeup.notify_all();
+		}
+		current->run();
+		{
+			std::unique_lock<std::mutex> lock(current->mutex);
+			current->finished.wait(lock, [&]() { return current->done.load() == count; });
+		}
+		if (current->error) std::rethrow_exception(current->error);
+	}
+
+	// template cache
+
+	template_cache::template_cache(loader load, std::size_t capacity) : load(load), capacity(capacity), active_shards(shard_count), count(0)
+	{
+		if (!capacity) return;
+		// at least 4 entries per shard, for the eviction order to stay meaningful
+		active_shards = std::max<std::size_t>(1, std::min(shard_count, capacity / 4));
+		for (std::size_t i = 0; i < active_shards; ++i) shards[i].capacity = capacity / active_shards + (i < capacity % active_shards);
+	}
+
+	tiny_template_ptr template_cache::get(const std::string &name)
+	{
+		tiny_template_ptr tmpl = lookup(&shard::by_name, name);
+		if (tmpl) return tmpl;
+		if (!load) throw parsing_error("template '" + name + "' not found");
+		return insert(&shard::by_name, name, tiny_template::parse(load(name)), false);
+	}
+
+	tiny_template_ptr template_cache::parse(const std::string &source)
+	{
+		tiny_template_ptr tmpl = lookup(&shard::by_source, source);
+		if (tmpl) return tmpl;
+		return insert(&shard::by_source, source, tiny_template::parse(source), false);
+	}
+
+	void template_cache::put(const std::string &name, tiny_template_ptr tmpl)
+	{
+		insert(&shard::by_name, name, tmpl, true);
+	}
+
+	bool template_cache::erase(const std::string &name)
+	{
+		shard &sh = shard_of(name);
+		std::unique_lock<std::shared_mutex> lock(sh.mutex);
+		entries::iterator it = sh.by_name.find(name);
+		if (it == sh.by_name.end()) return false;
+		remove(sh, sh.by_name, it);
+		return true;
+	}
+
+	void template_cache::clear()
+	{
+		for (shard &sh : shards)
+		{
+			std::unique_lock<std::shared_mutex> lock(sh.mutex);
+			count -= sh.by_name.size() + sh.by_source.size();
+			sh.by_name.clear();
+			sh.by_source.clear();
+			sh.ring.clear();
+			sh.hand = sh.ring.end();
+		}
+	}
+
+	tiny_template_ptr template_cache::lookup(entries shard::*table, const std::string &key)
+	{
+		shard &sh = shard_of(key);
+		std::shared_lock<std::shared_mutex> lock(sh.mutex);
+		entries::const_iterator it = (sh.*table).find(key);
+		if (it == (sh.*table).end()) return tiny_template_ptr();
+		// only written when it changes, to keep the entry cache line shared between readers
+		if (capacity && !it->second->used.load(std::memory_order_relaxed)) it->second->used.store(true, std::memory_order_relaxed);
+		return it->second->tmpl;
+	}
+
+	tiny_template_ptr template_cache::insert(entries shard::*table, const std::string &key, tiny_template_ptr tmpl, bool replace)
+	{
+		shard &sh = shard_of(key);
+		std::unique_lock<std::shared_mutex> lock(sh.mutex);
+		entries::iterator it = (sh.*table).find(key);
+		if (it != (sh.*table).end())
+		{
+			// concurrently inserted: keep the first one, unless explicitly replaced
+			if (replace) it->second->tmpl = tmpl;
+			return it->second->tmpl;
+		}
+		while (sh.capacity && sh.by_name.size() + sh.by_source.size() >= sh.capacity) evict(sh);
+		// new entries go right behind the hand, to be swept last
+		std::list<slot>::iterator position = sh.ring.insert(sh.hand, slot { table == &shard::by_source, key });
+		(sh.*table).emplace(key, std::unique_ptr<entry>(new entry(tmpl, position)));
+		++count;
+		return tmpl;
+	}
+
+	void template_cache::evict(shard &sh)
+	{
+		// CLOCK: entries used since the last sweep get a second chance
+		for (;;)
+		{
+			if (sh.hand == sh.ring.end()) sh.hand = sh.ring.begin();
+			entries &table = sh.hand->by_source ? sh.by_source : sh.by_name;
+			entries::iterator it = table.find(sh.hand->key);
+			if (it->second->used.exchange(false, std::memory_order_relaxed)) ++sh.hand;
+			else return remove(sh, table, it);
+		}
+	}
+
+	void template_cache::remove(shard &sh, entries &table, entries::iterator it)
+	{
+		if (sh.hand == it->second->position) sh.hand = sh.ring.erase(sh.hand);
+		else sh.ring.erase(it->second->position);
+		table.erase(it);
+		--count;
+	}
+
+	template_cache::loader template_cache::file_loader(const std::string &directory)
+	{
+		return [directory](const std::string &name)
+		{
+			std::string path = directory.empty() ? name : directory + "/" + name;
+			std::ifstream in(path, std::ios::binary);
+			if (!in) throw parsing_error("cannot read template file '" + path + "'");
+			return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		};
+	}
+
 } // namespace ttl
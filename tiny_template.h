@@ -21,9 +21,29 @@
 #define __TINY_TEMPLATE__
 
 #include <boost/any.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <list>
 #include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 // Tiny Template Language
@@ -43,6 +63,11 @@
 //
 //   --> will produce the output: result: hello world - items = item_1,item_2
 //
+//   or, to avoid building intermediate strings, write through a sink:
+//
+//		ttl::stream_sink out(std::cout);
+//		tmpl->evaluate_to(out, ctx);
+//
 // Syntax reference ( brackets [ ] denote optional portions ):
 //
 //   {$reference[.property[.property...]]}
@@ -53,39 +78,665 @@
 namespace ttl
 {
     // context
-    
-    // boost::any values can be: string, std::vector<boost::any> and map<string, boost::any>
-    typedef std::map<std::string, boost::any> map;
-    typedef std::vector<boost::any> vector;
+
+    class value;
+    typedef std::map<std::string, value> map;
+    typedef std::vector<value> vector;
     using context = map;
 
-    // utility
+    // legacy boost::any based containers, still accepted as values
+    // boost::any values can be: string, const char*, integral and floating point numbers, bool,
+    // std::vector<boost::any> and map<string, boost::any>
+    typedef std::map<std::string, boost::any> any_map;
+    typedef std::vector<boost::any> any_vector;
+
+    // lazy value: computed on demand, only when a render reaches it, and at most once
+    // per render if memoized; resolve() may get called concurrently by concurrent renders
+    class provider
+    {
+    public:
+        virtual ~provider() {}
+        virtual value resolve() const = 0;
+        virtual bool memoize() const { return true; }
+    };
+    typedef std::shared_ptr<const provider> provider_ptr;
+
+    // template value: a tagged union of string, borrowed string view, integer, real, boolean,
+    // vector, map and lazy value. Strings of up to small_capacity chars are stored inline.
+    class value
+    {
+    public:
+        enum class kind : unsigned char { null, string, string_view, integer, real, boolean, vector, map, lazy };
+        static const std::size_t small_capacity = 15;
+
+        value() : tag(kind::null) {}
+        value(const char *str) { set_string(str, str ? std::char_traits<char>::length(str) : 0); }
+        value(const std::string &str) { set_string(str.data(), str.size()); }
+        // borrowed string: the viewed chars must outlive the value
+        explicit value(std::string_view str) : tag(kind::string_view) { chars.data = str.data(); chars.size = str.size(); }
+        template <typename T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+        value(T i) : tag(kind::integer) { integer = static_cast<std::int64_t>(i); }
+        value(double d) : tag(kind::real) { real = d; }
+        value(bool b) : tag(kind::boolean) { boolean = b; }
+        value(const vector &v);
+        value(vector &&v);
+        value(const map &m);
+        value(map &&m);
+        value(const any_vector &v);
+        value(const any_map &m);
+        value(provider_ptr p);
+        explicit value(const boost::any &any);
+        value(const value &other) : tag(kind::null) { copy(other); }
+        value(value &&other) noexcept : tag(kind::null) { steal(other); }
+        ~value() { clear(); }
+
+        value & operator = (const value &other) { if (this != &other) { clear(); copy(other); } return *this; }
+        value & operator = (value &&other) noexcept { if (this != &other) { clear(); steal(other); } return *this; }
+
+        kind type() const { return tag; }
+        bool is_null() const { return tag == kind::null; }
+        bool is_string() const { return tag == kind::string || tag == kind::string_view; }
+        bool is_vector() const { return tag == kind::vector; }
+        bool is_map() const { return tag == kind::map; }
+        bool is_lazy() const { return tag == kind::lazy; }
+
+        // accessors throw an evaluation_error on type mismatch
+        std::string_view as_string() const;
+        std::int64_t as_integer() const;
+        double as_real() const;
+        bool as_boolean() const;
+        const vector & as_vector() const;
+        vector & as_vector();
+        const map & as_map() const;
+        map & as_map();
+        const provider & as_provider() const;
+
+        // map entry, or nullptr if not a map or missing key
+        const value * find(const std::string &key) const;
+        // truth value: null, empty strings and containers, zero and false are false
+        // (lazy values get resolved, without memoization, by test() and to_string())
+        bool test() const;
+        std::string to_string() const;
+
+    private:
+        void set_string(const char *data, std::size_t size);
+        void copy(const value &other);
+        void steal(value &other);
+        void clear();
+        bool is_small() const { return tag == kind::string && small_size <= small_capacity; }
+
+        union
+        {
+            struct { const char *data; std::size_t size; } chars; // heap or borrowed string
+            char small[small_capacity];
+            std::int64_t integer;
+            double real;
+            bool boolean;
+            vector *vect;
+            map *object;
+            provider_ptr *source;
+        };
+        kind tag;
+        unsigned char small_size = 0; // inline string size, or small_capacity + 1 for heap strings
+    };
+
+    // conversion of legacy boost::any based contexts
+    context make_context(const any_map &m);
+
+    // lazy value computed by a callback
+    provider_ptr lazy(std::function<value()> compute, bool memoize = true);
+
+    // output sinks
+
+    struct sink
+    {
+        virtual ~sink() {}
+        virtual void write(const char *data, std::size_t size) = 0;
+        void write(const std::string &str) { write(str.data(), str.size()); }
+    };
+
+    // appends to a caller string
+    template <typename String> class basic_string_sink : public sink
+    {
+    public:
+        basic_string_sink(String &target) : target(target) {}
+        virtual void write(const char *data, std::size_t size) { target.append(data, size); }
+        using sink::write;
+    private:
+        String &target;
+    };
+    typedef basic_string_sink<std::string> string_sink;
+
+    // writes to an output stream
+    class stream_sink : public sink
+    {
+    public:
+        stream_sink(std::ostream &out) : out(out) {}
+        virtual void write(const char *data, std::size_t size) { out.write(data, size); }
+        using sink::write;
+    private:
+        std::ostream &out;
+    };
 
-    std::string to_json(const context &ctx);
+    // writes into a fixed-size caller buffer; output past the capacity is dropped,
+    // but still counted, so that required() gives the full output size
+    class buffer_sink : public sink
+    {
+    public:
+        buffer_sink(char *buffer, std::size_t capacity) : buffer(buffer), capacity(capacity), length(0) {}
+        virtual void write(const char *data, std::size_t size);
+        using sink::write;
+        std::size_t size() const { return length < capacity ? length : capacity; }
+        std::size_t required() const { return length; }
+        bool overflow() const { return length > capacity; }
+    private:
+        char *buffer;
+        std::size_t capacity;
+        std::size_t length;
+    };
+
+    // forwards each chunk to a callback
+    class callback_sink : public sink
+    {
+    public:
+        typedef std::function<void(const char *, std::size_t)> callback;
+        callback_sink(callback fn) : fn(fn) {}
+        virtual void write(const char *data, std::size_t size) { fn(data, size); }
+        using sink::write;
+    private:
+        callback fn;
+    };
     
+    // utility
+
+    // output escaping of rendered values:
+    // html: & < > " ' as entities
+    // json: the inside of a JSON string
+    // url: percent-encoding of everything but unreserved chars (RFC 3986)
+    enum class escape_mode { none, html, json, url };
+
+    void escape(sink &out, std::string_view str, escape_mode mode);
+
+    enum class json_style { compact, pretty };
+
+    // JSON serialization, with strings escaped; non finite reals are written as null
+    std::string to_json(const context &ctx, json_style style = json_style::compact);
+    void to_json(sink &out, const context &ctx, json_style style = json_style::compact);
+    void to_json(sink &out, const value &val, json_style style = json_style::compact);
+
+    // copy: all strings are copied in the context
+    // borrow: strings without escape sequences are borrowed from the json input, which must outlive the context
+    enum class json_mode { copy, borrow };
+
+    // JSON deserialization of an object; integers without fraction nor exponent become integer values,
+    // other numbers real values. Throws a parsing_error on malformed input.
+    context from_json(std::string_view json, json_mode mode = json_mode::copy);
+
+    class indexed_context;
+
     // grammar
     
+    struct parallel_options;
+
     namespace ast
     {
         struct node;
+        struct lazy_store;
+        struct memoizer;
+        struct compiler;
+        struct assembler;
+        struct optimizer;
+        struct program;
+        struct profiler;
         typedef std::shared_ptr<node> node_ptr;
+
+        // evaluation scope: the context, overlaid by the loop variables of the enclosing
+        // #join directives, each frame pointing to its parent (nothing gets copied)
+        struct scope
+        {
+            scope(const map &params, const indexed_context *index = nullptr, std::pmr::memory_resource *scratch = nullptr, lazy_store *lazy = nullptr)
+                : params(&params), index(index), parent(nullptr), name(nullptr), value(nullptr),
+                  scratch(scratch ? scratch : std::pmr::get_default_resource()), lazy(lazy), memo(nullptr), parallel(nullptr), profile(nullptr) {}
+            scope(const scope &parent, const std::string &name, const ttl::value &value)
+                : params(parent.params), index(parent.index), parent(&parent), name(&name), value(&value),
+                  scratch(parent.scratch), lazy(parent.lazy), memo(nullptr), parallel(parent.parallel), profile(parent.profile) {}
+            const ttl::value * find(const std::string &key) const;
+            const map *params;
+            const indexed_context *index;
+            const scope *parent;
+            const std::string *name;
+            const ttl::value *value;
+            std::pmr::memory_resource *scratch; // render temporaries
+            lazy_store *lazy; // lazy values resolved by the render
+            memoizer *memo; // incremental render, outside of #join loops only
+            const parallel_options *parallel; // parallel #join rendering
+            profiler *profile; // per-node render profile (TTL_PROFILE builds), serial renders only
+        };
         
         struct node
         {
             virtual ~node() {}
-            static node_ptr parse(const std::string &);
-            virtual std::string evaluate(const map &) = 0;
-			virtual bool test(const map &) = 0;
-            virtual std::string debug() = 0;
+            // hand-written parser
+            // nodes, and their literal text, get allocated from the arena if one is given;
+            // references without an escaping filter get the default escaping
+            static node_ptr parse(const std::string &, std::pmr::memory_resource *arena = nullptr, escape_mode escape = escape_mode::none);
+            // text nodes view the source, which must outlive the tree
+            static node_ptr parse_borrowed(std::string_view source, std::pmr::memory_resource *arena = nullptr,
+                                           escape_mode escape = escape_mode::none);
+            // reference Spirit X3 grammar, unless compiled with TTL_NO_SPIRIT
+            static node_ptr parse_spirit(const std::string &);
+            // merges adjacent text, collapses single-child sequences, folds #if directives with
+            // literal conditions and drops empty #else parts; returns the number of removed nodes
+            static std::size_t optimize(node_ptr &root);
+            std::string evaluate(const map &params) const;
+            std::string evaluate(const scope &params) const
+            {
+                std::string ret;
+                string_sink out(ret);
+                evaluate_to(out, params);
+                return ret;
+            }
+            void evaluate_to(sink &out, const map &params) const;
+            virtual void evaluate_to(sink &, const scope &) const = 0;
+            virtual bool test(const scope &) const = 0;
+            virtual std::string debug() const = 0;
+            virtual void compile(compiler &) = 0;
+            virtual void assemble(assembler &) const = 0;
+            // simplifies the children, and returns a replacement for the node itself, if any
+            virtual node_ptr simplify(optimizer &) { return node_ptr(); }
             template <typename T> T* get() { return dynamic_cast<T*>(this); }
+            template <typename T> const T* get() const { return dynamic_cast<const T*>(this); }
+            // source position (1-based line), set by the hand-written parser
+            std::size_t offset = 0, line = 0;
         };
         
     } // namespace ast
 
+    // symbols
+
+    // identifiers of a template, interned as dense integers
+    class symbol_table
+    {
+    public:
+        static const std::size_t npos = static_cast<std::size_t>(-1);
+        std::size_t intern(const std::string &name);
+        std::size_t find(const std::string &name) const;
+        const std::string & name(std::size_t id) const { return names[id]; }
+        std::size_t size() const { return names.size(); }
+    private:
+        std::map<std::string, std::size_t> ids;
+        std::vector<std::string> names;
+    };
+
     // template
-    
-    using tiny_template = ast::node;
-    using tiny_template_ptr = ast::node_ptr;
+
+    class tiny_template;
+    typedef std::shared_ptr<tiny_template> tiny_template_ptr;
+
+    struct parse_options
+    {
+        // allocate the whole tree from a single arena owned by the template
+        bool arena = false;
+        // simplify the tree, see ast::node::optimize()
+        bool optimize = false;
+        // escaping of references without a filter, like {$name}; {$name|raw} is never escaped
+        escape_mode escape = escape_mode::none;
+    };
+
+    // per-render scratch memory: a monotonic buffer, starting with an owned block which
+    // is kept across resets; a scratch arena must not be shared by concurrent renders
+    class scratch_arena
+    {
+    public:
+        scratch_arena(std::size_t initial_size = 16384) : block(new char[initial_size]), buffer(block.get(), initial_size) {}
+        std::pmr::memory_resource * resource() { return &buffer; }
+        // releases everything allocated since the last reset, for instance between requests
+        void reset() { buffer.release(); }
+    private:
+        std::unique_ptr<char[]> block;
+        std::pmr::monotonic_buffer_resource buffer;
+    };
+
+    // output fragments memoized by incremental renders: the output of each subtree outside of
+    // #join loops is reused as long as the hash of the context values it reads is unchanged.
+    // A memo serves one template at a time, and must not be shared by concurrent renders.
+    class render_memo
+    {
+    public:
+        std::size_t hits() const { return hit_count; }
+        std::size_t misses() const { return miss_count; }
+        void clear() { fragments.clear(); owner = 0; }
+    private:
+        friend struct ast::memoizer;
+        friend class tiny_template;
+        struct fragment
+        {
+            std::uint64_t key = 0;
+            bool valid = false;
+            std::string output;
+        };
+        std::uint64_t owner = 0; // id of the template, as its address may be reused once it is freed
+        std::unordered_map<const ast::node *, fragment> fragments;
+        std::vector<std::uint64_t> slot_hashes; // of the current render
+        std::vector<bool> hashed;
+        std::size_t hit_count = 0, miss_count = 0;
+    };
+
+    // fixed set of worker threads running parallel loops
+    class thread_pool
+    {
+    public:
+        explicit thread_pool(std::size_t threads = std::thread::hardware_concurrency());
+        ~thread_pool();
+        std::size_t size() const { return workers.size(); }
+        // runs task(i) for each i in [0, count), on idle workers and on the calling thread, which
+        // makes nested loops safe; the first exception thrown by a task is rethrown
+        void parallel_for(std::size_t count, const std::function<void(std::size_t)> &task);
+    private:
+        struct job;
+        void work();
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        std::deque<std::shared_ptr<job>> jobs;
+        bool stopping = false;
+    };
+
+    struct parallel_options
+    {
+        thread_pool *pool = nullptr;
+        // collections smaller than this are rendered serially
+        std::size_t threshold = 4096;
+    };
+
+#ifdef TTL_PROFILE
+    // Profiling is compiled in with TTL_PROFILE, which must then be defined for the whole build;
+    // without it, nothing is recorded and renders cost the same as before.
+
+    namespace profiling
+    {
+        // allocations made by the current thread: only counted if the program links
+        // ttl_profile_alloc.cpp, or its own global operator new incrementing it
+        extern thread_local std::size_t allocations;
+    }
+
+    // per-node statistics of tree renders, see tiny_template::evaluate(ctx, profile)
+    class render_profile
+    {
+    public:
+        struct entry
+        {
+            std::string label; // node kind and source, like "#join $row in $rows"
+            std::size_t offset = 0, line = 0; // in the template source
+            std::size_t calls = 0;
+            std::chrono::nanoseconds inclusive{0}, exclusive{0}; // with and without the child nodes
+            std::size_t bytes = 0; // emitted, child nodes included
+            std::size_t allocations = 0; // ... child nodes included
+        };
+        // entries by source position
+        std::vector<entry> entries() const;
+        // table of the entries, by decreasing exclusive time
+        void report(std::ostream &out) const;
+        // folded stacks ("outer;inner nanoseconds" lines), for flamegraph.pl and compatible viewers
+        void flame_graph(std::ostream &out) const;
+        void clear();
+    private:
+        friend struct ast::profiler;
+        std::unordered_map<const ast::node *, entry> nodes;
+        std::map<std::vector<const ast::node *>, std::chrono::nanoseconds> stacks; // exclusive times
+    };
+#endif
+
+    // parse and compile statistics of a template, recorded in TTL_PROFILE builds only
+    struct parse_metrics
+    {
+        std::chrono::nanoseconds parse{0}; // parsing and optimization
+        std::chrono::nanoseconds compile{0}; // slots and bytecode
+        std::size_t source_size = 0;
+        std::size_t nodes = 0;
+    };
+
+    // a parsed and compiled template
+    //
+    // Compilation interns every identifier in the symbol table and gives each distinct
+    // context path referenced by the template (like $a.b.c, but not paths rooted at a
+    // #join iterator) a dense slot number.
+    //
+    // Templates are also flattened into a bytecode program: a contiguous instruction array,
+    // with all literal text packed together, run by a non-virtual interpreter loop. The
+    // execute() methods render through this program, and produce the same output as
+    // evaluate(), which walks the tree.
+    //
+    // String results get reserved at once, from a size hint: initially a static estimate of
+    // the output size (literal text, plus heuristics for references and loops), which then
+    // learns from the actual sizes of previous renders, with bounded steps so that one-off
+    // large outputs don't inflate the reservations of the next renders.
+    //
+    // Parallel renders split the #join loops over large collections in chunks, rendered by a thread
+    // pool and spliced in order. Lazy values are then memoized per chunk rather than per render.
+    //
+    // Incremental renders, given a render_memo, only re-evaluate the subtrees whose inputs changed
+    // since the previous render with the same memo.
+    //
+    // Parsing with the arena option places all nodes in one monotonic arena, released with
+    // the template. Renders to a sink can take a scratch arena for their temporaries: the lazy
+    // values they resolve, and the loop frames of the bytecode program.
+    //
+    // A template is immutable once constructed: its const methods don't modify any shared
+    // state, so one template can be evaluated concurrently from any number of threads,
+    // as long as each context is not modified during the evaluations reading it.
+    class tiny_template
+    {
+    public:
+        typedef std::vector<std::size_t> path; // symbol ids
+        // storage: memory the tree points into (arena, mapped file), released with the template;
+        // source: the template source, if text nodes are slices of it
+        tiny_template(ast::node_ptr root, std::shared_ptr<const void> storage = nullptr, std::string_view source = std::string_view());
+        static tiny_template_ptr parse(const std::string &, const parse_options &options = parse_options());
+        // memory-mapped template file: literal text is neither copied at parse time nor at render time
+        static tiny_template_ptr parse_file(const std::string &path, const parse_options &options = parse_options());
+        std::string evaluate(const context &ctx) const;
+        std::string evaluate(const indexed_context &ctx) const;
+        void evaluate_to(sink &out, const context &ctx, scratch_arena *scratch = nullptr) const;
+        void evaluate_to(sink &out, const indexed_context &ctx, scratch_arena *scratch = nullptr) const;
+        std::string evaluate(const context &ctx, render_memo &memo) const;
+        void evaluate_to(sink &out, const context &ctx, render_memo &memo) const;
+        std::string evaluate(const context &ctx, const parallel_options &parallel) const;
+        void evaluate_to(sink &out, const context &ctx, const parallel_options &parallel) const;
+#ifdef TTL_PROFILE
+        // tree render, adding the statistics of each node to the profile
+        std::string evaluate(const context &ctx, render_profile &profile) const;
+        void evaluate_to(sink &out, const context &ctx, render_profile &profile) const;
+        const parse_metrics & parse_profile() const { return metrics; }
+#endif
+        // batch render, through the bytecode program, reusing buffers across items: each result is
+        // reported in order and from the calling thread, with its exception if it failed (the output
+        // view is only valid during the call); items are spread over the pool threads, if any
+        typedef std::function<void(std::size_t index, std::string_view output, std::exception_ptr error)> batch_sink;
+        void evaluate_batch(const context *contexts, std::size_t count, const batch_sink &out, thread_pool *pool = nullptr) const;
+        void evaluate_batch(const std::vector<context> &contexts, const batch_sink &out, thread_pool *pool = nullptr) const
+        {
+            evaluate_batch(contexts.data(), contexts.size(), out, pool);
+        }
+        std::string execute(const context &ctx) const;
+        std::string execute(const indexed_context &ctx) const;
+        void execute_to(sink &out, const context &ctx, scratch_arena *scratch = nullptr) const;
+        void execute_to(sink &out, const indexed_context &ctx, scratch_arena *scratch = nullptr) const;
+        // renders into a caller buffer, and returns the full output size: if it is
+        // greater than the capacity, the output has been truncated
+        std::size_t execute_to(char *buffer, std::size_t capacity, const context &ctx) const;
+        std::string debug() const;
+        const symbol_table & symbols() const { return symbol_ids; }
+        const std::vector<path> & slots() const { return slot_paths; }
+        // context paths the template may read, dotted, with [] standing for the items of
+        // a #join collection: "{#join $i in $items}{$i.name}{#end}" reads items and items[].name
+        const std::set<std::string> & dependencies() const { return dependency_paths; }
+        std::size_t static_size() const;
+        std::size_t size_hint() const { return hint.load(std::memory_order_relaxed); }
+    private:
+        friend class chunked_renderer;
+        friend std::string generate_cpp(const tiny_template &tmpl, const std::string &name);
+        template <typename Render> std::string render_string(Render render) const;
+        void learn(std::size_t size) const;
+        std::exception_ptr render_item(const context &ctx, std::string &buffer, scratch_arena &scratch) const;
+        std::shared_ptr<const void> storage; // must outlive the nodes
+        ast::node_ptr root;
+        symbol_table symbol_ids;
+        std::vector<path> slot_paths;
+        std::set<std::string> dependency_paths;
+        std::shared_ptr<const ast::program> bytecode;
+        mutable std::atomic<std::size_t> hint;
+        std::uint64_t id; // unique per process
+        parse_metrics metrics; // TTL_PROFILE builds
+    };
+
+    // a context bound to the slots of a template: each slot path gets resolved once,
+    // at construction, so that evaluation then looks references up by index.
+    // The context must outlive the indexed context, and must not be modified meanwhile.
+    class indexed_context
+    {
+    public:
+        indexed_context(const tiny_template &tmpl, const context &ctx);
+        const tiny_template & owner() const { return tmpl; }
+        const context & params() const { return ctx; }
+        const value * slot(std::size_t index) const { return values[index]; }
+    private:
+        const tiny_template &tmpl;
+        const context &ctx;
+        std::vector<const value *> values;
+    };
+
+    // template parsed from a memory-mapped file, and swapped atomically when the file changes; files
+    // must be replaced (written aside, then renamed) rather than rewritten in place while mapped
+    class template_file
+    {
+    public:
+        template_file(const std::string &path, const parse_options &options = parse_options());
+        // current template: renders keep the one they got alive across swaps
+        tiny_template_ptr get() const { return std::atomic_load(&current); }
+        // reparses the file if its modification time or size changed, and returns whether it was
+        // swapped; on errors, the current template is kept
+        bool refresh();
+    private:
+        std::string path;
+        parse_options options;
+        std::mutex reload;
+        std::filesystem::file_time_type modified;
+        std::uintmax_t file_size = 0;
+        tiny_template_ptr current;
+    };
+
+    // resumable render, producing the output in bounded chunks through the bytecode program, for
+    // instance for a network writer pulling them at its own pace; the template and the context must
+    // outlive the renderer
+    class chunked_renderer
+    {
+    public:
+        chunked_renderer(const tiny_template &tmpl, const context &ctx, std::size_t chunk_size = 16384);
+        ~chunked_renderer();
+        chunked_renderer(const chunked_renderer &) = delete;
+        chunked_renderer & operator = (const chunked_renderer &) = delete;
+        // next chunk, of at most chunk_size bytes, valid until the next call; empty once done
+        std::string_view next();
+        bool done() const;
+    private:
+        struct state;
+        std::unique_ptr<state> current;
+    };
+
+    // ahead-of-time compilation: C++ source of a header defining render functions with the same output
+    // as tmpl.evaluate(ctx), void <name>(sink &, const context &) and std::string <name>(const context &);
+    // literal text becomes constants, references direct lookups and directives native control flow
+    // (see ttlc.cpp, which generates such headers from template files)
+    std::string generate_cpp(const tiny_template &tmpl, const std::string &name);
+
+    namespace generated
+    {
+        // runtime of the generated render functions
+        class render_state
+        {
+        public:
+            render_state(const context &ctx);
+            ~render_state();
+            render_state(const render_state &) = delete;
+            render_state & operator = (const render_state &) = delete;
+            // context entry, or nullptr
+            const value * find(const std::string &key) const;
+            // value of a reference path, given the value of its first identifier (nullptr if missing)
+            const value & resolve(const value *first, const std::string *path, std::size_t size) const;
+            // reference condition: false if the path doesn't resolve
+            bool test(const value *first, const std::string *path, std::size_t size) const;
+            void write(sink &out, const value &val, escape_mode mode) const;
+            // three-way comparison of condition operands
+            static int compare(const value &left, const value &right);
+            // items of a #join collection, a non-vector value being a single item
+            static std::pair<const value *, const value *> items(const value &collection);
+        private:
+            std::unique_ptr<ast::lazy_store> lazy;
+            ast::scope params;
+        };
+    }
+
+    // thread-safe cache of parsed templates, keyed by name or by source content
+    //
+    // Entries are spread over shards, each guarded by its own shared mutex, so that
+    // concurrent lookups of cached templates only take shared locks. Templates missing
+    // from the cache are loaded through the loader callback and parsed outside of any lock.
+    // When a capacity is given, it is split among the shards (small caches use fewer shards),
+    // and inserting into a full shard evicts one of its entries, approximating LRU with the
+    // CLOCK algorithm: lookups only mark entries as used, and evictions give them a second chance.
+    class template_cache
+    {
+    public:
+        typedef std::function<std::string(const std::string &name)> loader;
+        template_cache(loader load = loader(), std::size_t capacity = 0);
+        // template of the given name, loaded on first use
+        tiny_template_ptr get(const std::string &name);
+        // template parsed from the given source, cached by content
+        tiny_template_ptr parse(const std::string &source);
+        void put(const std::string &name, tiny_template_ptr tmpl);
+        bool erase(const std::string &name);
+        void clear();
+        std::size_t size() const { return count.load(std::memory_order_relaxed); }
+        // loader reading templates from files in the given directory
+        static loader file_loader(const std::string &directory = std::string());
+    private:
+        static constexpr std::size_t shard_count = 16;
+        // key of an entry, in the eviction ring of its shard
+        struct slot
+        {
+            bool by_source;
+            std::string key;
+        };
+        struct entry
+        {
+            entry(tiny_template_ptr tmpl, std::list<slot>::iterator position) : tmpl(tmpl), used(false), position(position) {}
+            tiny_template_ptr tmpl;
+            std::atomic<bool> used; // set by lookups, cleared by the eviction sweeps
+            std::list<slot>::iterator position;
+        };
+        typedef std::unordered_map<std::string, std::unique_ptr<entry>> entries;
+        struct shard
+        {
+            mutable std::shared_mutex mutex;
+            entries by_name;
+            entries by_source;
+            std::list<slot> ring; // entries, swept by the hand of the eviction clock
+            std::list<slot>::iterator hand = ring.end();
+            std::size_t capacity = 0;
+        };
+        tiny_template_ptr lookup(entries shard::*table, const std::string &key);
+        tiny_template_ptr insert(entries shard::*table, const std::string &key, tiny_template_ptr tmpl, bool replace);
+        void evict(shard &sh);
+        void remove(shard &sh, entries &table, entries::iterator it);
+        shard & shard_of(const std::string &key) { return shards[std::hash<std::string>()(key) % active_shards]; }
+
+        loader load;
+        std::size_t capacity;
+        std::size_t active_shards;
+        std::atomic<std::size_t> count;
+        shard shards[shard_count];
+    };
 
     // errors
     
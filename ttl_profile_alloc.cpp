@@ -0,0 +1,34 @@
+#include <cstdlib>
+#include <new>
+#include "tiny_template.h"
+
+// allocation counting for render profiles: replaces the global operator new and delete of the
+// program it gets linked into, to count the allocations of each thread in ttl::profiling::allocations
+//
+// opt-in, for builds with TTL_PROFILE defined:
+// g++ -std=c++17 -DTTL_PROFILE ... tiny_template.cpp ttl_profile_alloc.cpp
+
+#ifndef TTL_PROFILE
+#error "ttl_profile_alloc.cpp is only useful in builds with TTL_PROFILE defined"
+#endif
+
+void * operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    ++ttl::profiling::allocations;
+    return std::malloc(size ? size : 1);
+}
+
+void * operator new(std::size_t size)
+{
+    if (void *p = operator new(size, std::nothrow)) return p;
+    throw std::bad_alloc();
+}
+
+void * operator new[](std::size_t size) { return operator new(size); }
+void * operator new[](std::size_t size, const std::nothrow_t &) noexcept { return operator new(size, std::nothrow); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
@@ -0,0 +1,74 @@
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "tiny_template.h"
+
+// ahead-of-time template compiler: generates a C++ header defining a render function with
+// the same output as tiny_template::evaluate(), see ttl::generate_cpp()
+//
+// compile with:
+// g++ -std=c++17 -pthread ttlc.cpp tiny_template.cpp -o ttlc
+//
+// usage: ttlc [--escape=html|json|url] <template file> <header file> [function name]
+// the function name defaults to render_<template file name, without extension>
+
+namespace
+{
+    int usage()
+    {
+        std::cerr << "usage: ttlc [--escape=html|json|url] <template file> <header file> [function name]" << std::endl;
+        return 2;
+    }
+
+    // render_<stem>, with chars not allowed in identifiers replaced by underscores
+    std::string function_name(const std::string &path)
+    {
+        std::string name = "render_" + std::filesystem::path(path).stem().string();
+        for (char &c : name)
+        {
+            if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) c = '_';
+        }
+        return name;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    ttl::parse_options options;
+    options.optimize = true;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!std::strncmp(argv[i], "--escape=", 9))
+        {
+            std::string mode = argv[i] + 9;
+            if (mode == "html") options.escape = ttl::escape_mode::html;
+            else if (mode == "json") options.escape = ttl::escape_mode::json;
+            else if (mode == "url") options.escape = ttl::escape_mode::url;
+            else return usage();
+        }
+        else args.push_back(argv[i]);
+    }
+    if (args.size() < 2 || args.size() > 3) return usage();
+    try
+    {
+        ttl::tiny_template_ptr tmpl = ttl::tiny_template::parse_file(args[0], options);
+        std::string header = ttl::generate_cpp(*tmpl, args.size() == 3 ? args[2] : function_name(args[0]));
+        std::ofstream out(args[1], std::ios::binary);
+        out << header;
+        if (!out.flush())
+        {
+            std::cerr << "ttlc: cannot write '" << args[1] << "'" << std::endl;
+            return 1;
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "ttlc: " << args[0] << ": " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}